@@ -5,6 +5,13 @@ import random
 LARGEST_DISK_SIZE_BYTES = 100_000_000
 FS_FILE_MAX_COUNT = 128
 
+# The root directory grows past FS_FILE_MAX_COUNT files, unlike in fs_ref.x
+LARGE_EMPTY_FILE_HEADER = """# Creates one file more than fits in a single root directory block (128
+# entries). The reference implementation (fs_ref.x) stops at file_fs129 with
+# "Cannot create file"; this implementation grows the root directory with
+# extension blocks, so all 129 files are created and then deleted.
+"""
+
 # filename = "file_that_is_larger_than_disk"
 # if not os.path.exists(filename):
 #     with open(filename, "w") as file:
@@ -14,6 +21,7 @@ FS_FILE_MAX_COUNT = 128
 
 script_name = "large_empty_file1.script"
 with open(script_name, "w") as file:
+	file.write(LARGE_EMPTY_FILE_HEADER)
 	file.write("MOUNT\n")
 	for i in range(FS_FILE_MAX_COUNT + 1):
 		file.write("CREATE	file_fs" + str(i + 1) + "\n")
@@ -23,6 +31,7 @@ with open(script_name, "w") as file:
 
 script_name = "large_empty_file2.script"
 with open(script_name, "w") as file:
+	file.write(LARGE_EMPTY_FILE_HEADER)
 	file.write("MOUNT\n")
 	for i in range(FS_FILE_MAX_COUNT):
 		file.write("CREATE	file_fs" + str(i + 1) + "\n")
@@ -54,3 +63,39 @@ with open(script_name, "w") as file:
 	for file_number in file_numbers:
 		file.write("DELETE	file_fs" + str(file_number + 1) + "\n")
 	file.write("UMOUNT\n")
+
+# Every metadata change is in the journal once its command returns
+script_name = "journal_replay1.script"
+with open(script_name, "w") as file:
+	file.write("# Run with LIBFS_JOURNAL_BLOCKS=64 in the environment, so that the disk gets a\n")
+	file.write("# journal. Creates and deletes files in a directory that grows past one block,\n")
+	file.write("# syncs one file with FSYNC, and gets killed before UMOUNT. Run\n")
+	file.write("# journal_replay2.script on the same disk next to check that replaying the\n")
+	file.write("# journal at mount brings back every change.\n")
+	file.write("MOUNT\n")
+	file.write("MKDIR	dir\n")
+	for i in range(FS_FILE_MAX_COUNT + 2):
+		file.write("CREATE	dir/file_fs" + str(i + 1) + "\n")
+	for i in range(0, FS_FILE_MAX_COUNT + 2, 2):
+		file.write("DELETE	dir/file_fs" + str(i + 1) + "\n")
+	file.write("CREATE	file_fs\n")
+	file.write("OPEN	file_fs\n")
+	file.write("WRITE	FILE	testFileLong\n")
+	file.write("FSYNC\n")
+	file.write("CRASH\n")
+
+script_name = "journal_replay2.script"
+with open(script_name, "w") as file:
+	file.write("# Runs after journal_replay1.script on the same disk.\n")
+	file.write("MOUNT\n")
+	file.write("OPEN	file_fs\n")
+	file.write("READ	10100	FILE	testFileLong\n")
+	file.write("CLOSE\n")
+	for i in range(FS_FILE_MAX_COUNT + 2):
+		if i % 2 == 0:
+			file.write("FAIL	DELETE	dir/file_fs" + str(i + 1) + "\n")
+		else:
+			file.write("DELETE	dir/file_fs" + str(i + 1) + "\n")
+	file.write("DELETE	dir\n")
+	file.write("DELETE	file_fs\n")
+	file.write("UMOUNT\n")
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +35,47 @@ struct thread_arg {
 	char **argv;
 };
 
+/*
+ * Check that the current script command failed if it was prefixed with FAIL,
+ * and that it succeeded otherwise. Evaluate to whether it failed.
+ */
+#define script_failed(failed, ...)						\
+({														\
+	int __failed = !!(failed);							\
+	if (__failed != expect_fail) {						\
+		fs_umount();									\
+		if (__failed)									\
+			die(__VA_ARGS__);							\
+		die("%s did not fail", command);				\
+	}													\
+	if (__failed)										\
+		printf("%s failed as expected.\n", command);	\
+	__failed;											\
+})
+
+/*
+ * Split the @len bytes of @buf into buffers of @size bytes, the last one
+ * possibly shorter, and return how many there are
+ */
+static int split_buffer(struct iovec **iov, char *buf, int len, int size)
+{
+	int i, iovcnt;
+
+	if (size <= 0)
+		die("invalid buffer size");
+
+	iovcnt = (len + size - 1) / size;
+	*iov = calloc(iovcnt ? iovcnt : 1, sizeof(struct iovec));
+	if (!*iov)
+		die_perror("calloc");
+
+	for (i = 0; i < iovcnt; i++) {
+		(*iov)[i].iov_base = buf + i * size;
+		(*iov)[i].iov_len = i < iovcnt - 1 ? size : len - i * size;
+	}
+	return iovcnt;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -41,10 +83,11 @@ void thread_fs_script(void *arg)
 	char *diskname, *script;
 	FILE *fd_script;
 	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
+	const int total_command_parts = 6;
 	char *command_args[total_command_parts];
 	int offset;
 	char mounted = 0;
+	int expect_fail;
 
 	char line_buffer[1024];
 	int command_index = 1;
@@ -71,10 +114,16 @@ void thread_fs_script(void *arg)
 
 		/* Tokenize line */
 		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
+		for (command_index = 1; command_index < total_command_parts; command_index++)
 			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
+
+		/* Commands prefixed with FAIL must fail */
+		expect_fail = command_args[0] && strcmp(command_args[0], "FAIL") == 0;
+		if (expect_fail) {
+			memmove(command_args, command_args + 1,
+					(total_command_parts - 1) * sizeof(char *));
+			command_args[total_command_parts - 1] = NULL;
+		}
 		command = command_args[0];
 
 		int data_fd;
@@ -86,6 +135,10 @@ void thread_fs_script(void *arg)
 		if (!command)
 			break;
 
+		/* Skip comment lines */
+		if (command[0] == '#')
+			continue;
+
 		if (strcmp(command, "MOUNT") == 0) {
 			if (fs_mount(diskname))
 				die("Cannot mount disk");
@@ -105,56 +158,61 @@ void thread_fs_script(void *arg)
 		} else if (strcmp(command, "CREATE") == 0) {
 			fs_filename = command_args[1];
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
-				die("Cannot create file");
-			}
+			if (script_failed(fs_create(fs_filename), "Cannot create file"))
+				continue;
 
 			printf("CREATE successful.\n");
 
 		} else if (strcmp(command, "DELETE") == 0) {
 			fs_filename = command_args[1];
 
-			if(fs_delete(fs_filename)) {
-				fs_umount();
-				die("Cannot delete file");
-			}
+			if (script_failed(fs_delete(fs_filename), "Cannot delete file"))
+				continue;
 
 			printf("DELETE successful.\n");
 
 		} else if (strcmp(command, "OPEN") == 0) {
 			fs_filename = command_args[1];
 
-			fs_fd = fs_open(fs_filename);
-
-			if (fs_fd < 0) {
+			if (!command_args[2])
+				fs_fd = fs_open(fs_filename);
+			else if (strcmp(command_args[2], "BUFFERED") == 0)
+				fs_fd = fs_open_flags(fs_filename, FS_OPEN_BUFFERED);
+			else {
 				fs_umount();
-				die("Cannot open file");
+				die("Unknown open flag: %s", command_args[2]);
 			}
 
+			if (script_failed(fs_fd < 0, "Cannot open file"))
+				continue;
+
 			printf("OPEN successful.\n");
 
 		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
-				fs_umount();
-				die("Cannot close file");
-			}
+			if (script_failed(fs_close(fs_fd), "Cannot close file"))
+				continue;
 
 			printf("CLOSE successful.\n");
 
 		} else if (strcmp(command, "SEEK") == 0) {
 			offset = atoi(command_args[1]);
 
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
-				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
-			}
+			if (script_failed(fs_lseek(fs_fd, offset), "Cannot seek to position"))
+				continue;
+
+			printf("SEEK successful.\n");
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
+		} else if (strcmp(command, "WRITE") == 0 || strcmp(command, "PWRITE") == 0
+				   || strcmp(command, "WRITEV") == 0) {
+			/*
+			 * PWRITE takes the offset to write at first, and WRITEV the size
+			 * of the buffers to split the data into
+			 */
+			char **write_args = command_args;
+			if (strcmp(command, "WRITE") != 0)
+				write_args++;
+			data_source = write_args[1];
+			data_description = write_args[2];
 
 			if (strcmp(data_source, "DATA") == 0) {
 				data = data_description;
@@ -185,17 +243,33 @@ void thread_fs_script(void *arg)
 				die_perror("Could not find data to write");
 			}
 
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
-				fs_umount();
-				die("write error");
+			if (strcmp(command, "PWRITE") == 0) {
+				count = fs_pwrite(fs_fd, data, data_size, atoi(command_args[1]));
+			} else if (strcmp(command, "WRITEV") == 0) {
+				struct iovec *iov;
+				int iovcnt = split_buffer(&iov, data, data_size,
+										  atoi(command_args[1]));
+				count = fs_writev(fs_fd, iov, iovcnt);
+				free(iov);
+			} else {
+				count = fs_write(fs_fd, data, data_size);
 			}
+			if (script_failed(count < 0, "write error"))
+				continue;
 			printf("Wrote %d bytes to file.\n", count);
 
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
+		} else if (strcmp(command, "READ") == 0 || strcmp(command, "PREAD") == 0
+				   || strcmp(command, "READV") == 0) {
+			/*
+			 * PREAD takes the offset to read from first, and READV the size of
+			 * the buffers to split the data read into
+			 */
+			char **read_args = command_args;
+			if (strcmp(command, "READ") != 0)
+				read_args++;
+			int read_req_length = atoi(read_args[1]);
+			data_source = read_args[2];
+			data_description = read_args[3];
 
 			char file_loaded = 0;
 
@@ -240,11 +314,24 @@ void thread_fs_script(void *arg)
 			}
 
 			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+			if (strcmp(command, "PREAD") == 0) {
+				count = fs_pread(fs_fd, read_buf, read_req_length,
+								 atoi(command_args[1]));
+			} else if (strcmp(command, "READV") == 0) {
+				struct iovec *iov;
+				int iovcnt = split_buffer(&iov, read_buf, read_req_length,
+										  atoi(command_args[1]));
+				count = fs_readv(fs_fd, iov, iovcnt);
+				free(iov);
+			} else {
+				count = fs_read(fs_fd, read_buf, read_req_length);
+			}
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
+			if (script_failed(count < 0, "read error")) {
+				free(read_buf);
+				if (file_loaded)
+					free(data);
+				continue;
 			}
 
 			// both data and read_buf were allocated with an extra zero byte
@@ -258,6 +345,48 @@ void thread_fs_script(void *arg)
 			if(file_loaded){
 				free(data);
 			}
+
+		} else if (strcmp(command, "MKDIR") == 0) {
+			if (script_failed(fs_mkdir(command_args[1]), "Cannot create directory"))
+				continue;
+
+			printf("MKDIR successful.\n");
+
+		} else if (strcmp(command, "LS") == 0) {
+			struct fs_dirent entries[16];
+			size_t cursor = 0;
+			int i;
+
+			while ((count = fs_readdir(command_args[1] ? command_args[1] : "/",
+									   &cursor, entries, ARRAY_SIZE(entries))) > 0) {
+				for (i = 0; i < count; i++)
+					printf("%s: %s, size: %zu\n",
+						   entries[i].is_directory ? "dir" : "file",
+						   entries[i].name, entries[i].size);
+			}
+
+			if (script_failed(count < 0, "Cannot read directory"))
+				continue;
+
+			printf("LS successful.\n");
+
+		} else if (strcmp(command, "SYNC") == 0) {
+			if (script_failed(fs_sync(), "Cannot sync"))
+				continue;
+
+			printf("SYNC successful.\n");
+
+		} else if (strcmp(command, "FSYNC") == 0) {
+			if (script_failed(fs_fsync(fs_fd), "Cannot sync file"))
+				continue;
+
+			printf("FSYNC successful.\n");
+
+		} else if (strcmp(command, "CRASH") == 0) {
+			/* Get killed while still mounted, without unmounting */
+			printf("CRASH\n");
+			fflush(stdout);
+			kill(getpid(), SIGKILL);
 		}
 	}
 
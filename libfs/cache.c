@@ -0,0 +1,664 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* End of a hash chain */
+#define NO_ENTRY -1
+/* The cache lock was dropped to wait for a read, look the block up again */
+#define RETRY_ENTRY -2
+
+/* Asynchronous reads started together by cache_prefetch() */
+struct cache_batch {
+	/* Number of entries still waiting on one of the requests, and of
+	 * threads waiting for one of them to complete */
+	size_t pending;
+	/* Requests were handed to the block layer */
+	int submitted;
+	struct block_request *requests;
+	void **bufs;
+};
+
+/* Cached block description */
+struct cache_entry {
+	/* Index of the cached block on disk */
+	size_t block;
+	/* Next entry in the same hash bucket */
+	int next;
+	/* Entry holds a block */
+	char valid;
+	/* Block was modified since it was read or last written back */
+	char dirty;
+	/* Block was accessed since the clock hand last passed over it */
+	char referenced;
+	/* Batch of the read filling the entry, if it may still be in flight */
+	struct cache_batch *batch;
+	int request;
+};
+
+/* Buffer cache instance, all of it under the lock */
+static struct {
+	pthread_mutex_t lock;
+	/* Entries and their data, entry i owning data[i * BLOCK_SIZE] */
+	struct cache_entry *entries;
+	char *data;
+	size_t num_entries;
+	/* Hash buckets, heads of chains of entries */
+	int *buckets;
+	size_t bucket_mask;
+	/* Clock hand */
+	size_t hand;
+	/* Number of valid and dirty entries */
+	size_t num_valid;
+	size_t num_dirty;
+	struct cache_stats stats;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t cache_hash(size_t block)
+{
+	/* Fibonacci hashing spreads consecutive blocks over the buckets */
+	return (block * 11400714819323198485ull) >> 32 & cache.bucket_mask;
+}
+
+static char *cache_data(int idx)
+{
+	return &cache.data[(size_t)idx * BLOCK_SIZE];
+}
+
+static int cache_lookup(size_t block)
+{
+	int idx = cache.buckets[cache_hash(block)];
+
+	while (idx != NO_ENTRY && cache.entries[idx].block != block)
+		idx = cache.entries[idx].next;
+
+	return idx;
+}
+
+static void cache_unlink(int idx)
+{
+	int *link = &cache.buckets[cache_hash(cache.entries[idx].block)];
+
+	while (*link != idx)
+		link = &cache.entries[*link].next;
+	*link = cache.entries[idx].next;
+}
+
+/*
+ * Finish the prefetch read of entry @idx, if any, once it completed. Only wait
+ * for it if @wait is set. Return 1 if it is still in flight, -1 if it failed,
+ * in which case the entry does not hold valid data.
+ */
+static int cache_settle(int idx, int wait)
+{
+	struct cache_entry *entry = &cache.entries[idx];
+	struct cache_batch *batch = entry->batch;
+	struct block_request *req;
+	int ret;
+
+	if (!batch)
+		return 0;
+
+	req = &batch->requests[entry->request];
+	if (block_reap(req, 1, wait) == 0)
+		return 1;
+	ret = req->result == 0 ? 0 : -1;
+
+	entry->batch = NULL;
+	if (--batch->pending == 0)
+		free(batch);
+
+	return ret;
+}
+
+/*
+ * Wait for the prefetch read of entry @idx to complete with the cache lock
+ * dropped, so that other blocks are served meanwhile. The batch is kept
+ * around, but the entry may be settled or reused by the time the lock is
+ * taken again.
+ */
+static void cache_wait(int idx)
+{
+	struct cache_entry *entry = &cache.entries[idx];
+	struct cache_batch *batch = entry->batch;
+	struct block_request *req = &batch->requests[entry->request];
+
+	batch->pending++;
+	pthread_mutex_unlock(&cache.lock);
+	block_reap(req, 1, 1);
+	pthread_mutex_lock(&cache.lock);
+	if (--batch->pending == 0)
+		free(batch);
+}
+
+/* Forget about settled entry @idx, its content being written back or not needed */
+static void cache_drop(int idx)
+{
+	struct cache_entry *entry = &cache.entries[idx];
+
+	cache_unlink(idx);
+	if (entry->dirty)
+		cache.num_dirty--;
+	entry->valid = 0;
+	entry->dirty = 0;
+	cache.num_valid--;
+}
+
+static int cache_writeback(int idx)
+{
+	struct cache_entry *entry = &cache.entries[idx];
+
+	if (block_write(entry->block, cache_data(idx)) == -1)
+		return -1;
+
+	entry->dirty = 0;
+	cache.num_dirty--;
+	cache.stats.writebacks++;
+
+	return 0;
+}
+
+/*
+ * Find a free entry, evicting the first unreferenced block under the hand.
+ * If every block is being prefetched, wait for one of them if @wait is set
+ * and return RETRY_ENTRY, or give up otherwise.
+ */
+static int cache_victim(int wait)
+{
+	int in_flight = NO_ENTRY;
+
+	for (size_t scanned = 0; ; scanned++) {
+		int idx = cache.hand;
+		struct cache_entry *entry = &cache.entries[idx];
+
+		/* Two rounds clear every referenced bit on the way */
+		if (scanned == 2 * cache.num_entries) {
+			if (!wait || in_flight == NO_ENTRY)
+				return NO_ENTRY;
+			cache_wait(in_flight);
+			return RETRY_ENTRY;
+		}
+
+		cache.hand = (cache.hand + 1) % cache.num_entries;
+
+		if (!entry->valid)
+			return idx;
+
+		/* Blocks being prefetched right now are not candidates */
+		if (entry->batch && !entry->batch->submitted)
+			continue;
+		int ret = cache_settle(idx, 0);
+		if (ret == 1) {
+			in_flight = idx;
+			continue;
+		}
+		if (ret == -1) {
+			cache_drop(idx);
+			return idx;
+		}
+
+		if (entry->referenced) {
+			entry->referenced = 0;
+			continue;
+		}
+
+		if (entry->dirty && cache_writeback(idx) == -1)
+			return NO_ENTRY;
+
+		cache_drop(idx);
+		cache.stats.evictions++;
+		return idx;
+	}
+}
+
+/* Get the entry of block @block, reading it from disk if @fill is set */
+static int cache_get(size_t block, int fill)
+{
+	int idx;
+
+	do {
+		idx = cache_lookup(block);
+
+		/* A failed prefetch leaves the block to be read again */
+		if (idx != NO_ENTRY) {
+			int ret = cache_settle(idx, 0);
+			if (ret == 1) {
+				cache_wait(idx);
+				idx = RETRY_ENTRY;
+				continue;
+			}
+			if (ret == -1) {
+				cache_drop(idx);
+				idx = NO_ENTRY;
+			}
+		}
+
+		if (idx != NO_ENTRY) {
+			cache.entries[idx].referenced = 1;
+			cache.stats.hits++;
+			return idx;
+		}
+
+		idx = cache_victim(1);
+	} while (idx == RETRY_ENTRY);
+
+	cache.stats.misses++;
+	if (idx == NO_ENTRY)
+		return NO_ENTRY;
+
+	if (fill && block_read(block, cache_data(idx)) == -1)
+		return NO_ENTRY;
+
+	struct cache_entry *entry = &cache.entries[idx];
+	size_t bucket = cache_hash(block);
+	entry->block = block;
+	entry->valid = 1;
+	entry->dirty = 0;
+	entry->referenced = 1;
+	entry->batch = NULL;
+	entry->next = cache.buckets[bucket];
+	cache.buckets[bucket] = idx;
+	cache.num_valid++;
+
+	return idx;
+}
+
+int cache_init(size_t num_blocks)
+{
+	size_t num_buckets = 1;
+
+	if (cache.entries) {
+		cache_error("cache already set up");
+		return -1;
+	}
+
+	if (num_blocks == 0 || num_blocks > INT32_MAX) {
+		cache_error("invalid cache size '%zu'", num_blocks);
+		return -1;
+	}
+
+	/* Keep chains short with at least two buckets per entry */
+	while (num_buckets < 2 * num_blocks)
+		num_buckets <<= 1;
+
+	cache.entries = calloc(num_blocks, sizeof(struct cache_entry));
+	cache.buckets = malloc(num_buckets * sizeof(int));
+	/* Aligned slots can be transferred with direct I/O without bouncing */
+	if (posix_memalign((void **)&cache.data, BLOCK_SIZE,
+			   num_blocks * BLOCK_SIZE))
+		cache.data = NULL;
+
+	if (!cache.entries || !cache.buckets || !cache.data) {
+		free(cache.entries);
+		free(cache.buckets);
+		free(cache.data);
+		cache.entries = NULL;
+		return -1;
+	}
+
+	for (size_t i = 0; i < num_buckets; i++)
+		cache.buckets[i] = NO_ENTRY;
+
+	cache.num_entries = num_blocks;
+	cache.bucket_mask = num_buckets - 1;
+	cache.hand = 0;
+	cache.num_valid = 0;
+	cache.num_dirty = 0;
+	memset(&cache.stats, 0, sizeof(cache.stats));
+
+	return 0;
+}
+
+/* Functions prefixed with __, like the static helpers above, expect the cache lock to be held */
+
+static int __cache_read(size_t block, void *buf, size_t offset, size_t len)
+{
+	int idx;
+
+	if (offset > BLOCK_SIZE || len > BLOCK_SIZE - offset) {
+		cache_error("range out of block (%zu+%zu)", offset, len);
+		return -1;
+	}
+
+	idx = cache_get(block, 1);
+	if (idx == NO_ENTRY)
+		return -1;
+
+	memcpy(buf, cache_data(idx) + offset, len);
+
+	return 0;
+}
+
+int cache_read(size_t block, void *buf, size_t offset, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache.lock);
+	ret = __cache_read(block, buf, offset, len);
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+int cache_peek(size_t block, void *buf, size_t offset, size_t len)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&cache.lock);
+	if (cache_lookup(block) != NO_ENTRY)
+		ret = __cache_read(block, buf, offset, len) == -1 ? -1 : 1;
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+static int __cache_prefetch(const size_t *blocks, size_t count)
+{
+	struct cache_batch *batch;
+	int *indexes;
+	size_t num_indexes = 0, num_requests = 0;
+
+	/* Never let a single batch take over the cache */
+	if (count > cache.num_entries / 2)
+		count = cache.num_entries / 2;
+	if (count == 0)
+		return 0;
+
+	batch = malloc(sizeof(*batch) + count * sizeof(struct block_request)
+		       + count * sizeof(void *));
+	indexes = malloc(count * sizeof(int));
+	if (!batch || !indexes) {
+		free(batch);
+		free(indexes);
+		return -1;
+	}
+	batch->requests = (struct block_request *)(batch + 1);
+	batch->bufs = (void **)(batch->requests + count);
+	batch->submitted = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t block = blocks[i];
+		struct cache_entry *entry;
+		int idx;
+
+		if (cache_lookup(block) != NO_ENTRY)
+			continue;
+
+		/* Entries being set up must not be seen with the lock dropped */
+		idx = cache_victim(0);
+		if (idx == NO_ENTRY)
+			break;
+
+		entry = &cache.entries[idx];
+		size_t bucket = cache_hash(block);
+		entry->block = block;
+		entry->valid = 1;
+		entry->dirty = 0;
+		entry->referenced = 1;
+		entry->batch = batch;
+		entry->next = cache.buckets[bucket];
+		cache.buckets[bucket] = idx;
+		cache.num_valid++;
+		indexes[num_indexes] = idx;
+
+		/* Consecutive blocks share a single request */
+		batch->bufs[num_indexes] = cache_data(idx);
+		if (num_requests > 0) {
+			struct block_request *last = &batch->requests[num_requests - 1];
+			if (last->block + last->count == block) {
+				last->count++;
+				entry->request = num_requests - 1;
+				num_indexes++;
+				continue;
+			}
+		}
+		struct block_request *req = &batch->requests[num_requests];
+		req->block = block;
+		req->count = 1;
+		req->bufs = &batch->bufs[num_indexes];
+		req->write = 0;
+		entry->request = num_requests++;
+		num_indexes++;
+	}
+
+	batch->pending = num_indexes;
+	if (num_indexes > 0 && block_submit(batch->requests, num_requests) == 0) {
+		batch->submitted = 1;
+		cache.stats.prefetches += num_indexes;
+		free(indexes);
+		return 0;
+	}
+
+	/* Nothing was started: forget about the entries */
+	for (size_t i = 0; i < num_indexes; i++) {
+		cache.entries[indexes[i]].batch = NULL;
+		cache_drop(indexes[i]);
+	}
+	free(batch);
+	free(indexes);
+
+	return num_indexes > 0 ? -1 : 0;
+}
+
+int cache_prefetch(const size_t *blocks, size_t count)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache.lock);
+	ret = __cache_prefetch(blocks, count);
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+static int __cache_write(size_t block, const void *buf, size_t offset, size_t len,
+			 int fill)
+{
+	struct cache_entry *entry;
+	int idx;
+
+	if (offset > BLOCK_SIZE || len > BLOCK_SIZE - offset) {
+		cache_error("range out of block (%zu+%zu)", offset, len);
+		return -1;
+	}
+
+	/*
+	 * A block that gets entirely overwritten does not need to be read, nor
+	 * does one whose other bytes are unused, which are zeroed instead
+	 */
+	idx = cache_get(block, fill && len < BLOCK_SIZE);
+	if (idx == NO_ENTRY)
+		return -1;
+
+	if (!fill) {
+		memset(cache_data(idx), 0, offset);
+		memset(cache_data(idx) + offset + len, 0, BLOCK_SIZE - offset - len);
+	}
+	memcpy(cache_data(idx) + offset, buf, len);
+
+	entry = &cache.entries[idx];
+	if (!entry->dirty) {
+		entry->dirty = 1;
+		cache.num_dirty++;
+	}
+
+	return 0;
+}
+
+int cache_write(size_t block, const void *buf, size_t offset, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache.lock);
+	ret = __cache_write(block, buf, offset, len, 1);
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+int cache_overwrite(size_t block, const void *buf, size_t offset, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache.lock);
+	ret = __cache_write(block, buf, offset, len, 0);
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+static void __cache_invalidate_range(size_t block, size_t count)
+{
+	/* Blocks still being read are waited for and looked at again */
+	if (count <= cache.num_entries) {
+		for (size_t i = 0; i < count && cache.num_valid > 0; i++) {
+			int idx;
+			while ((idx = cache_lookup(block + i)) != NO_ENTRY) {
+				if (cache_settle(idx, 0) == 1)
+					cache_wait(idx);
+				else
+					cache_drop(idx);
+			}
+		}
+		return;
+	}
+
+	for (size_t idx = 0; idx < cache.num_entries && cache.num_valid > 0;
+	     idx++) {
+		struct cache_entry *entry = &cache.entries[idx];
+		if (!entry->valid || entry->block < block
+		    || entry->block - block >= count)
+			continue;
+		if (cache_settle(idx, 0) == 1) {
+			cache_wait(idx);
+			idx--;
+			continue;
+		}
+		cache_drop(idx);
+	}
+}
+
+void cache_invalidate_range(size_t block, size_t count)
+{
+	pthread_mutex_lock(&cache.lock);
+	__cache_invalidate_range(block, count);
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static int cache_compare_blocks(const void *a, const void *b)
+{
+	size_t block_a = cache.entries[*(const int *)a].block;
+	size_t block_b = cache.entries[*(const int *)b].block;
+
+	return (block_a > block_b) - (block_a < block_b);
+}
+
+static int __cache_sync(void)
+{
+	const void **bufs;
+	int *dirty;
+	size_t num_dirty = 0;
+	int ret = 0;
+
+	if (cache.num_dirty == 0)
+		return 0;
+
+	dirty = malloc(cache.num_dirty * sizeof(int));
+	bufs = malloc(cache.num_dirty * sizeof(void *));
+	if (!dirty || !bufs) {
+		free(dirty);
+		free(bufs);
+		return -1;
+	}
+
+	/* Write dirty blocks in disk order, merging consecutive ones */
+	for (size_t idx = 0; idx < cache.num_entries; idx++) {
+		if (cache.entries[idx].dirty)
+			dirty[num_dirty++] = idx;
+	}
+	qsort(dirty, num_dirty, sizeof(int), cache_compare_blocks);
+
+	for (size_t i = 0; i < num_dirty; ) {
+		size_t first = cache.entries[dirty[i]].block;
+		size_t run = 0;
+
+		while (i + run < num_dirty
+		       && cache.entries[dirty[i + run]].block == first + run) {
+			bufs[run] = cache_data(dirty[i + run]);
+			run++;
+		}
+
+		if (block_writev(first, bufs, run) == -1) {
+			ret = -1;
+		} else {
+			for (size_t j = 0; j < run; j++) {
+				cache.entries[dirty[i + j]].dirty = 0;
+				cache.num_dirty--;
+				cache.stats.writebacks++;
+			}
+		}
+		i += run;
+	}
+
+	free(dirty);
+	free(bufs);
+
+	return ret;
+}
+
+int cache_sync(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache.lock);
+	ret = __cache_sync();
+	pthread_mutex_unlock(&cache.lock);
+
+	return ret;
+}
+
+int cache_destroy(void)
+{
+	int ret;
+
+	if (!cache.entries) {
+		cache_error("cache not set up");
+		return -1;
+	}
+
+	ret = __cache_sync();
+
+	for (size_t idx = 0; idx < cache.num_entries; idx++)
+		cache_settle(idx, 1);
+
+	free(cache.entries);
+	free(cache.buckets);
+	free(cache.data);
+	cache.entries = NULL;
+
+	return ret;
+}
+
+int cache_get_stats(struct cache_stats *stats)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&cache.lock);
+	if (cache.entries)
+		*stats = cache.stats;
+	else
+		ret = -1;
+	pthread_mutex_unlock(&cache.lock);
+
+	if (ret == -1)
+		cache_error("cache not set up");
+
+	return ret;
+}
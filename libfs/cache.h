@@ -0,0 +1,158 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Number of blocks cached when the cache size is not configured */
+#define CACHE_DEFAULT_BLOCKS 256
+
+/** Environment variable overriding the number of cached blocks */
+#define CACHE_BLOCKS_ENV "LIBFS_CACHE_BLOCKS"
+
+/**
+ * struct cache_stats - Buffer cache counters
+ * @hits: Number of accesses served from the cache
+ * @misses: Number of accesses that had to read the block from disk
+ * @evictions: Number of blocks evicted to make room for others
+ * @writebacks: Number of dirty blocks written back to disk
+ * @prefetches: Number of blocks read ahead of time with cache_prefetch()
+ */
+struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+	size_t prefetches;
+};
+
+/**
+ * cache_init - Set up the buffer cache
+ * @num_blocks: Number of blocks the cache can hold
+ *
+ * Set up a write-back cache of @num_blocks blocks in front of the currently
+ * open virtual disk. When the cache is full, blocks are evicted with the CLOCK
+ * algorithm and written back to disk if they are dirty.
+ *
+ * Once set up, the cache can be used from several threads at once: each of the
+ * functions below is atomic with respect to the others. Only cache_init() and
+ * cache_destroy() must not run concurrently with any other cache function.
+ *
+ * Return: -1 if the cache is already set up, if @num_blocks is 0 or if memory
+ * cannot be allocated. 0 otherwise.
+ */
+int cache_init(size_t num_blocks);
+
+/**
+ * cache_destroy - Tear down the buffer cache
+ *
+ * Write back every dirty block, then release the cache.
+ *
+ * Return: -1 if the cache is not set up or if a dirty block cannot be written
+ * back. 0 otherwise.
+ */
+int cache_destroy(void);
+
+/**
+ * cache_read - Read part of a block through the cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with @len bytes
+ * @offset: Offset of the first byte to read within the block
+ * @len: Number of bytes to read
+ *
+ * Copy @len bytes at @offset of block @block into buffer @buf, loading the
+ * block in the cache first if it is not there yet.
+ *
+ * Return: -1 if the range is not within a block or if the block cannot be read
+ * from disk. 0 otherwise.
+ */
+int cache_read(size_t block, void *buf, size_t offset, size_t len);
+
+/**
+ * cache_peek - Read part of a block if it is cached
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with @len bytes
+ * @offset: Offset of the first byte to read within the block
+ * @len: Number of bytes to read
+ *
+ * Same as cache_read(), except that a block which is not in the cache is left
+ * alone. Blocks read without the cache must first be peeked at, as the cache
+ * may hold a more recent version of them.
+ *
+ * Return: -1 if the block is cached but cannot be read. 1 if the block was
+ * cached and has been copied into @buf. 0 otherwise.
+ */
+int cache_peek(size_t block, void *buf, size_t offset, size_t len);
+
+/**
+ * cache_prefetch - Start loading blocks in the cache
+ * @blocks: Array of block indexes
+ * @count: Number of blocks in @blocks
+ *
+ * Start reading the blocks of @blocks that are not cached yet with the
+ * asynchronous block engine, and return without waiting for them. Consecutive
+ * blocks are read with a single request. Accessing a block whose read is still
+ * in flight waits for it to complete.
+ *
+ * Return: -1 if the reads cannot be started. 0 otherwise.
+ */
+int cache_prefetch(const size_t *blocks, size_t count);
+
+/**
+ * cache_write - Write part of a block through the cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer holding @len bytes
+ * @offset: Offset of the first byte to write within the block
+ * @len: Number of bytes to write
+ *
+ * Copy @len bytes of buffer @buf at @offset of block @block in the cache and
+ * mark the block dirty. The block is only read from disk first if it is not
+ * cached and the write does not cover it entirely.
+ *
+ * Return: -1 if the range is not within a block or if the block cannot be read
+ * from disk. 0 otherwise.
+ */
+int cache_write(size_t block, const void *buf, size_t offset, size_t len);
+
+/**
+ * cache_overwrite - Write part of a block whose other bytes are unused
+ * @block: Index of the block to write to
+ * @buf: Data buffer holding @len bytes
+ * @offset: Offset of the first byte to write within the block
+ * @len: Number of bytes to write
+ *
+ * Like cache_write(), except that the block is never read from disk: the bytes
+ * of the block outside of the range are zeroed instead. To be called when
+ * writing past the data held by the block.
+ *
+ * Return: -1 if the range is not within a block, or if no room can be made for
+ * the block in the cache. 0 otherwise.
+ */
+int cache_overwrite(size_t block, const void *buf, size_t offset, size_t len);
+
+/**
+ * cache_invalidate_range - Drop a range of cached blocks
+ * @block: Index of the first block of the range
+ * @count: Number of blocks in the range
+ *
+ * Drop the cached copies of the blocks of the range without writing them back.
+ * To be called when writing blocks without the cache, or when their content is
+ * no longer needed.
+ */
+void cache_invalidate_range(size_t block, size_t count);
+
+/**
+ * cache_sync - Write back every dirty block
+ *
+ * Return: -1 if a block cannot be written back. 0 otherwise.
+ */
+int cache_sync(void);
+
+/**
+ * cache_get_stats - Get buffer cache counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Return: -1 if the cache is not set up. 0 otherwise.
+ */
+int cache_get_stats(struct cache_stats *stats);
+
+#endif /* _CACHE_H */
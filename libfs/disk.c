@@ -1,10 +1,27 @@
+#define _GNU_SOURCE /* for O_DIRECT */
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define DISK_HAVE_URING
+/* <linux/fs.h>, pulled in by io_uring, has its own notion of a block */
+#undef BLOCK_SIZE
+#endif
+
 #include "disk.h"
 
 #define block_error(fmt, ...) \
@@ -13,18 +30,692 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Maximum number of blocks moved by a single preadv()/pwritev() call */
+#ifdef IOV_MAX
+#define DISK_IOV_MAX IOV_MAX
+#else
+#define DISK_IOV_MAX 1024
+#endif
+
+/* Alignment of block buffers, suitable for O_DIRECT */
+#define DISK_ALIGN 4096
+
+/* Maximum number of released block buffers kept for reuse */
+#define BUFFER_POOL_MAX 64
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Mapping of the whole disk file (NULL for the system-call backend) */
+	char *map;
+	/* Opened with O_DIRECT: buffers must be aligned on %DISK_ALIGN */
+	int direct;
 };
 
 /* Currently open virtual disk (invalid by default) */
 static struct disk disk = { .fd = INVALID_FD };
 
-int block_disk_open(const char *diskname)
+/* Pool of released block buffers, linked through their first bytes */
+static struct {
+	pthread_mutex_t lock;
+	void *head;
+	size_t count;
+} buffer_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void *block_buffer_alloc(void)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&buffer_pool.lock);
+	if (buffer_pool.head) {
+		buf = buffer_pool.head;
+		buffer_pool.head = *(void **)buf;
+		buffer_pool.count--;
+	}
+	pthread_mutex_unlock(&buffer_pool.lock);
+
+	if (!buf && posix_memalign(&buf, DISK_ALIGN, BLOCK_SIZE))
+		return NULL;
+
+	return buf;
+}
+
+void block_buffer_free(void *buf)
+{
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&buffer_pool.lock);
+	if (buffer_pool.count < BUFFER_POOL_MAX) {
+		*(void **)buf = buffer_pool.head;
+		buffer_pool.head = buf;
+		buffer_pool.count++;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&buffer_pool.lock);
+
+	free(buf);
+}
+
+static int disk_aligned(const void *buf)
+{
+	return ((uintptr_t)buf & (DISK_ALIGN - 1)) == 0;
+}
+
+/*
+ * Positional I/O never touches the shared file offset, so concurrent callers
+ * cannot race on it. Both helpers loop until @len bytes have been transferred,
+ * retrying on EINTR and resuming after short transfers.
+ */
+static int disk_pread_full(void *buf, size_t len, off_t offset)
+{
+	char *p = buf;
+
+	while (len > 0) {
+		ssize_t ret = pread(disk.fd, p, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk at offset %lld",
+				    (long long)offset);
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int disk_pwrite_full(const void *buf, size_t len, off_t offset)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t ret = pwrite(disk.fd, p, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pwrite");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("no progress writing at offset %lld",
+				    (long long)offset);
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Vectored counterpart of the helpers above. @iov is consumed in place: on a
+ * short transfer, the entries already transferred are skipped and the partial
+ * one is adjusted before the call is reissued.
+ */
+static int disk_prwv_full(struct iovec *iov, int iovcnt, off_t offset,
+			  int write)
+{
+	while (iovcnt > 0) {
+		ssize_t ret;
+
+		if (write)
+			ret = pwritev(disk.fd, iov, iovcnt, offset);
+		else
+			ret = preadv(disk.fd, iov, iovcnt, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk at offset %lld",
+				    (long long)offset);
+			return -1;
+		}
+		offset += ret;
+
+		/* Skip fully transferred entries, then trim the partial one */
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int block_rwv(size_t block, void *const bufs[], size_t count, int write)
+{
+	struct iovec iov[DISK_IOV_MAX];
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	/* Memory-mapped backend: no kernel round trip at all */
+	if (disk.map) {
+		for (size_t i = 0; i < count; i++) {
+			char *addr = disk.map + (block + i) * BLOCK_SIZE;
+			if (write)
+				memcpy(addr, bufs[i], BLOCK_SIZE);
+			else
+				memcpy(bufs[i], addr, BLOCK_SIZE);
+		}
+		return 0;
+	}
+
+	while (count > 0) {
+		size_t n = count < DISK_IOV_MAX ? count : DISK_IOV_MAX;
+		int ret = 0;
+
+		for (size_t i = 0; i < n; i++) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = BLOCK_SIZE;
+
+			/* O_DIRECT cannot transfer from unaligned buffers */
+			if (disk.direct && !disk_aligned(bufs[i])) {
+				iov[i].iov_base = block_buffer_alloc();
+				if (!iov[i].iov_base) {
+					block_error("cannot allocate bounce buffer");
+					iov[i].iov_base = bufs[i];
+					ret = -1;
+				} else if (write) {
+					memcpy(iov[i].iov_base, bufs[i], BLOCK_SIZE);
+				}
+			}
+		}
+
+		/* The transfer consumes @iov, so keep track of the bounce buffers */
+		void *bounce[n];
+		for (size_t i = 0; i < n; i++)
+			bounce[i] = iov[i].iov_base != bufs[i] ? iov[i].iov_base : NULL;
+
+		if (ret == 0)
+			ret = disk_prwv_full(iov, n, (off_t)block * BLOCK_SIZE, write);
+
+		for (size_t i = 0; i < n; i++) {
+			if (!bounce[i])
+				continue;
+			if (ret == 0 && !write)
+				memcpy(bufs[i], bounce[i], BLOCK_SIZE);
+			block_buffer_free(bounce[i]);
+		}
+
+		if (ret)
+			return -1;
+
+		block += n;
+		bufs += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Asynchronous engine
+ *
+ * Requests are handed to io_uring when the kernel supports it. Otherwise, or
+ * when LIBFS_DISK_NO_URING is set, a small pool of worker threads serves them
+ * with the synchronous vectored helpers. With the memory-mapped backend there
+ * is nothing to wait for, so requests are completed right away.
+ */
+enum engine_kind {
+	ENGINE_NONE,
+	ENGINE_URING,
+	ENGINE_THREADS,
+};
+
+/* Maximum number of requests in flight in the io_uring submission queue */
+#define URING_DEPTH 64
+
+/* Number of worker threads of the fallback engine */
+#define ENGINE_WORKERS 4
+
+static struct {
+	enum engine_kind kind;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Requests submitted but not completed yet */
+	size_t inflight;
+#ifdef DISK_HAVE_URING
+	int ring_fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned depth;
+	/* Entries queued in the submission ring but not submitted yet */
+	unsigned sq_pending;
+	/* A thread waits for completions in the kernel, without the lock */
+	int reaping;
+#endif
+	pthread_t workers[ENGINE_WORKERS];
+	size_t num_workers;
+	struct block_request *queue_head, *queue_tail;
+	int stopping;
+} engine = {
+	.kind = ENGINE_NONE,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Mark @req as complete (engine lock held) */
+static void engine_complete(struct block_request *req, int result)
+{
+	free(req->priv);
+	req->priv = NULL;
+	req->result = result;
+	req->done = 1;
+	engine.inflight--;
+	pthread_cond_broadcast(&engine.cond);
+}
+
+#ifdef DISK_HAVE_URING
+/*
+ * Hand every queued entry to the kernel and, if @min_complete is non-zero,
+ * wait for that many completions (engine lock held)
+ */
+static int uring_enter(unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, engine.ring_fd,
+			      engine.sq_pending, min_complete, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		perror("io_uring_enter");
+		return -1;
+	}
+	engine.sq_pending -= ret;
+
+	return 0;
+}
+
+/* Wait for a completion in the ring, without submitting anything */
+static int uring_wait(void)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, engine.ring_fd, 0, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		perror("io_uring_enter");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int uring_start(void)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+	if (fd < 0)
+		return -1;
+
+	engine.ring_fd = fd;
+	engine.depth = p.sq_entries;
+	engine.sq_pending = 0;
+	engine.reaping = 0;
+	engine.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	engine.cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (engine.cq_ring_size > engine.sq_ring_size)
+			engine.sq_ring_size = engine.cq_ring_size;
+		engine.cq_ring_size = engine.sq_ring_size;
+	}
+
+	engine.sq_ring = mmap(NULL, engine.sq_ring_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (engine.sq_ring == MAP_FAILED)
+		goto err_fd;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		engine.cq_ring = engine.sq_ring;
+	} else {
+		engine.cq_ring = mmap(NULL, engine.cq_ring_size,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, fd,
+				      IORING_OFF_CQ_RING);
+		if (engine.cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+
+	engine.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	engine.sqes = mmap(NULL, engine.sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (engine.sqes == MAP_FAILED)
+		goto err_cq;
+
+	engine.sq_head = (unsigned *)((char *)engine.sq_ring + p.sq_off.head);
+	engine.sq_tail = (unsigned *)((char *)engine.sq_ring + p.sq_off.tail);
+	engine.sq_mask = (unsigned *)((char *)engine.sq_ring + p.sq_off.ring_mask);
+	engine.sq_array = (unsigned *)((char *)engine.sq_ring + p.sq_off.array);
+	engine.cq_head = (unsigned *)((char *)engine.cq_ring + p.cq_off.head);
+	engine.cq_tail = (unsigned *)((char *)engine.cq_ring + p.cq_off.tail);
+	engine.cq_mask = (unsigned *)((char *)engine.cq_ring + p.cq_off.ring_mask);
+	engine.cqes = (struct io_uring_cqe *)((char *)engine.cq_ring +
+					      p.cq_off.cqes);
+
+	return 0;
+
+err_cq:
+	if (engine.cq_ring != engine.sq_ring)
+		munmap(engine.cq_ring, engine.cq_ring_size);
+err_sq:
+	munmap(engine.sq_ring, engine.sq_ring_size);
+err_fd:
+	close(fd);
+	return -1;
+}
+
+static void uring_stop(void)
+{
+	munmap(engine.sqes, engine.sqes_size);
+	if (engine.cq_ring != engine.sq_ring)
+		munmap(engine.cq_ring, engine.cq_ring_size);
+	munmap(engine.sq_ring, engine.sq_ring_size);
+	close(engine.ring_fd);
+}
+
+/* Finish a short or interrupted transfer synchronously */
+static int uring_finish(struct block_request *req, int res)
+{
+	struct iovec *iov = req->priv;
+	int iovcnt = req->count;
+	size_t done;
+
+	if (res < 0 && res != -EAGAIN && res != -EINTR) {
+		errno = -res;
+		perror(req->write ? "io_uring writev" : "io_uring readv");
+		return -1;
+	}
+
+	done = res > 0 ? (size_t)res : 0;
+	if (done == req->count * BLOCK_SIZE)
+		return 0;
+
+	/* Skip what the kernel already transferred and do the rest by hand */
+	off_t offset = (off_t)req->block * BLOCK_SIZE + done;
+	while (done >= iov->iov_len) {
+		done -= iov->iov_len;
+		iov++;
+		iovcnt--;
+	}
+	iov->iov_base = (char *)iov->iov_base + done;
+	iov->iov_len -= done;
+
+	return disk_prwv_full(iov, iovcnt, offset, req->write);
+}
+
+/* Process every available completion (engine lock held) */
+static void uring_harvest(void)
+{
+	unsigned head = *engine.cq_head;
+
+	while (head != __atomic_load_n(engine.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &engine.cqes[head & *engine.cq_mask];
+		struct block_request *req =
+			(struct block_request *)(uintptr_t)cqe->user_data;
+
+		engine_complete(req, uring_finish(req, cqe->res));
+		head++;
+	}
+	__atomic_store_n(engine.cq_head, head, __ATOMIC_RELEASE);
+}
+#endif /* DISK_HAVE_URING */
+
+/*
+ * Wait for requests to complete (engine lock held). The lock is dropped while
+ * waiting: with io_uring, one thread at a time waits in the kernel and
+ * harvests the completions for everybody, the others sleep until it is done.
+ */
+static int engine_wait(void)
+{
+#ifdef DISK_HAVE_URING
+	if (engine.kind == ENGINE_URING && !engine.reaping) {
+		int ret;
+
+		if (engine.sq_pending && uring_enter(0))
+			return -1;
+
+		engine.reaping = 1;
+		pthread_mutex_unlock(&engine.lock);
+		ret = uring_wait();
+		pthread_mutex_lock(&engine.lock);
+		engine.reaping = 0;
+
+		uring_harvest();
+		pthread_cond_broadcast(&engine.cond);
+		return ret;
+	}
+#endif
+	pthread_cond_wait(&engine.cond, &engine.lock);
+
+	return 0;
+}
+
+#ifdef DISK_HAVE_URING
+static int disk_bufs_aligned(const struct block_request *req)
+{
+	for (size_t i = 0; i < req->count; i++) {
+		if (!disk_aligned(req->bufs[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Queue @req in the submission ring (engine lock held) */
+static int uring_queue(struct block_request *req)
+{
+	struct iovec *iov;
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	iov = malloc(req->count * sizeof(*iov));
+	if (!iov)
+		return -1;
+	for (size_t i = 0; i < req->count; i++) {
+		iov[i].iov_base = req->bufs[i];
+		iov[i].iov_len = BLOCK_SIZE;
+	}
+
+	/* Make room in the ring by waiting for earlier requests */
+	while (engine.inflight >= engine.depth) {
+		if (engine_wait()) {
+			free(iov);
+			return -1;
+		}
+	}
+
+	tail = *engine.sq_tail;
+	idx = tail & *engine.sq_mask;
+	sqe = &engine.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = disk.fd;
+	sqe->off = (uint64_t)req->block * BLOCK_SIZE;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = req->count;
+	sqe->user_data = (uint64_t)(uintptr_t)req;
+	engine.sq_array[idx] = idx;
+	__atomic_store_n(engine.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	req->priv = iov;
+	engine.sq_pending++;
+	engine.inflight++;
+
+	return 0;
+}
+#endif /* DISK_HAVE_URING */
+
+static void *engine_worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&engine.lock);
+	for (;;) {
+		struct block_request *req;
+
+		while (!engine.queue_head && !engine.stopping)
+			pthread_cond_wait(&engine.cond, &engine.lock);
+		if (!engine.queue_head)
+			break;
+
+		req = engine.queue_head;
+		engine.queue_head = req->next;
+		if (!engine.queue_head)
+			engine.queue_tail = NULL;
+
+		pthread_mutex_unlock(&engine.lock);
+		int result = block_rwv(req->block, req->bufs, req->count,
+				       req->write);
+		pthread_mutex_lock(&engine.lock);
+
+		engine_complete(req, result);
+	}
+	pthread_mutex_unlock(&engine.lock);
+
+	return NULL;
+}
+
+static int threads_start(void)
+{
+	engine.stopping = 0;
+	engine.queue_head = engine.queue_tail = NULL;
+	for (engine.num_workers = 0; engine.num_workers < ENGINE_WORKERS;
+	     engine.num_workers++) {
+		if (pthread_create(&engine.workers[engine.num_workers], NULL,
+				   engine_worker, NULL))
+			break;
+	}
+
+	return engine.num_workers ? 0 : -1;
+}
+
+static void threads_stop(void)
+{
+	pthread_mutex_lock(&engine.lock);
+	engine.stopping = 1;
+	pthread_cond_broadcast(&engine.cond);
+	pthread_mutex_unlock(&engine.lock);
+
+	for (size_t i = 0; i < engine.num_workers; i++)
+		pthread_join(engine.workers[i], NULL);
+	engine.num_workers = 0;
+}
+
+/* Start the asynchronous engine on first use (engine lock held) */
+static int engine_start(void)
+{
+	if (engine.kind != ENGINE_NONE)
+		return 0;
+
+	engine.inflight = 0;
+#ifdef DISK_HAVE_URING
+	const char *no_uring = getenv("LIBFS_DISK_NO_URING");
+	if (!(no_uring && *no_uring && strcmp(no_uring, "0") != 0)
+	    && uring_start() == 0) {
+		engine.kind = ENGINE_URING;
+		return 0;
+	}
+#endif
+	if (threads_start() == 0) {
+		engine.kind = ENGINE_THREADS;
+		return 0;
+	}
+
+	block_error("cannot start asynchronous engine");
+	return -1;
+}
+
+/* Wait for every request in flight and tear the engine down */
+static void engine_stop(void)
+{
+	pthread_mutex_lock(&engine.lock);
+	if (engine.kind == ENGINE_NONE) {
+		pthread_mutex_unlock(&engine.lock);
+		return;
+	}
+	while (engine.inflight > 0 && engine_wait() == 0)
+		;
+#ifdef DISK_HAVE_URING
+	if (engine.kind == ENGINE_URING)
+		uring_stop();
+#endif
+	enum engine_kind kind = engine.kind;
+	engine.kind = ENGINE_NONE;
+	pthread_mutex_unlock(&engine.lock);
+
+	if (kind == ENGINE_THREADS)
+		threads_stop();
+}
+
+/*
+ * Open @diskname with O_DIRECT, making sure that the host file system actually
+ * accepts direct transfers: some reject the open, others only the I/O.
+ */
+static int disk_open_direct(const char *diskname)
+{
+	int fd = open(diskname, O_RDWR | O_DIRECT, 0644);
+	void *probe;
+
+	if (fd < 0)
+		return -1;
+
+	probe = block_buffer_alloc();
+	if (!probe || (pread(fd, probe, BLOCK_SIZE, 0) < 0 && errno == EINVAL)) {
+		block_buffer_free(probe);
+		close(fd);
+		return -1;
+	}
+	block_buffer_free(probe);
+
+	return fd;
+}
+
+int block_disk_open_flags(const char *diskname, int flags)
 {
 	int fd;
 	struct stat st;
@@ -39,13 +730,17 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	fd = -1;
+	if (flags & BLOCK_DISK_DIRECT)
+		fd = disk_open_direct(diskname);
+	if (fd < 0 && (fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
@@ -53,26 +748,88 @@ int block_disk_open(const char *diskname)
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
 		return -1;
 	}
 
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.map = NULL;
+	disk.direct = 0;
+
+	/* Fall back on the system-call backend if the file cannot be mapped */
+	if ((flags & BLOCK_DISK_MMAP) && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED)
+			disk.map = map;
+	}
+
+	/* Mapped accesses go through the page cache whatever the open mode */
+	if (!disk.map && (fcntl(fd, F_GETFL) & O_DIRECT))
+		disk.direct = 1;
 
 	return 0;
 }
 
+int block_disk_open(const char *diskname)
+{
+	const char *mmap_env = getenv(BLOCK_DISK_MMAP_ENV);
+	const char *direct_env = getenv(BLOCK_DISK_DIRECT_ENV);
+	int flags = 0;
+
+	if (mmap_env && *mmap_env && strcmp(mmap_env, "0") != 0)
+		flags |= BLOCK_DISK_MMAP;
+	if (direct_env && *direct_env && strcmp(direct_env, "0") != 0)
+		flags |= BLOCK_DISK_DIRECT;
+
+	return block_disk_open_flags(diskname, flags);
+}
+
 int block_disk_close(void)
 {
+	int ret = 0;
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
+	engine_stop();
+
+	if (disk.map) {
+		if (msync(disk.map, disk.bcount * BLOCK_SIZE, MS_SYNC)) {
+			perror("msync");
+			ret = -1;
+		}
+		munmap(disk.map, disk.bcount * BLOCK_SIZE);
+		disk.map = NULL;
+	}
+
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
 
+	return ret;
+}
+
+int block_disk_sync(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (disk.map && msync(disk.map, disk.bcount * BLOCK_SIZE, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
+
+	if (fdatasync(disk.fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -86,6 +843,14 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
+void *block_disk_map(void)
+{
+	if (disk.fd == INVALID_FD)
+		return NULL;
+
+	return disk.map;
+}
+
 int block_write(size_t block, const void *buf)
 {
 	if (disk.fd == INVALID_FD) {
@@ -99,19 +864,16 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
+	if (disk.map) {
+		memcpy(disk.map + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+		return 0;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
-	}
+	if (disk.direct && !disk_aligned(buf))
+		return block_writev(block, &buf, 1);
 
-	return 0;
+	/* Perform the actual write into the disk image */
+	return disk_pwrite_full(buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
 }
 
 int block_read(size_t block, void *buf)
@@ -127,18 +889,112 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
+	if (disk.map) {
+		memcpy(buf, disk.map + block * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
 	}
 
+	if (disk.direct && !disk_aligned(buf))
+		return block_readv(block, &buf, 1);
+
 	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return disk_pread_full(buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
+
+
+int block_writev(size_t block, const void *bufs[], size_t count)
+{
+	return block_rwv(block, (void *const *)bufs, count, 1);
+}
+
+int block_readv(size_t block, void *bufs[], size_t count)
+{
+	return block_rwv(block, bufs, count, 0);
+}
+
+int block_submit(struct block_request *reqs, size_t count)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
+	for (size_t i = 0; i < count; i++) {
+		reqs[i].result = -1;
+		reqs[i].done = 0;
+		reqs[i].next = NULL;
+		reqs[i].priv = NULL;
+	}
+
+	/* Nothing to wait for with the memory-mapped backend */
+	if (disk.map) {
+		for (size_t i = 0; i < count; i++) {
+			reqs[i].result = block_rwv(reqs[i].block, reqs[i].bufs,
+						   reqs[i].count, reqs[i].write);
+			reqs[i].done = 1;
+		}
+		return 0;
+	}
+
+	pthread_mutex_lock(&engine.lock);
+	if (engine_start()) {
+		pthread_mutex_unlock(&engine.lock);
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		struct block_request *req = &reqs[i];
+
+#ifdef DISK_HAVE_URING
+		if (engine.kind == ENGINE_URING) {
+			/* Oversized or unqueueable requests are served inline */
+			if (req->count == 0 || req->count > DISK_IOV_MAX
+			    || (disk.direct && !disk_bufs_aligned(req))
+			    || uring_queue(req)) {
+				req->result = block_rwv(req->block, req->bufs,
+							req->count, req->write);
+				req->done = 1;
+			}
+			continue;
+		}
+#endif
+		engine.inflight++;
+		if (engine.queue_tail)
+			engine.queue_tail->next = req;
+		else
+			engine.queue_head = req;
+		engine.queue_tail = req;
+	}
+
+#ifdef DISK_HAVE_URING
+	/* Submit the whole batch with a single system call */
+	if (engine.kind == ENGINE_URING && engine.sq_pending)
+		uring_enter(0);
+#endif
+	pthread_cond_broadcast(&engine.cond);
+	pthread_mutex_unlock(&engine.lock);
+
 	return 0;
 }
 
+size_t block_reap(struct block_request *reqs, size_t count, int wait)
+{
+	size_t completed;
+
+	pthread_mutex_lock(&engine.lock);
+	for (;;) {
+#ifdef DISK_HAVE_URING
+		/* Completions are left to the thread waiting for them, if any */
+		if (engine.kind == ENGINE_URING && !engine.reaping)
+			uring_harvest();
+#endif
+		completed = 0;
+		for (size_t i = 0; i < count; i++)
+			completed += reqs[i].done ? 1 : 0;
+		if (!wait || completed == count || engine_wait())
+			break;
+	}
+	pthread_mutex_unlock(&engine.lock);
+
+	return completed;
+}
@@ -6,6 +6,18 @@
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Map the whole virtual disk file in memory instead of using system calls */
+#define BLOCK_DISK_MMAP 0x1
+
+/** Bypass the host page cache by opening the virtual disk file with O_DIRECT */
+#define BLOCK_DISK_DIRECT 0x2
+
+/** Environment variable selecting the memory-mapped backend in block_disk_open() */
+#define BLOCK_DISK_MMAP_ENV "LIBFS_DISK_MMAP"
+
+/** Environment variable selecting direct I/O in block_disk_open() */
+#define BLOCK_DISK_DIRECT_ENV "LIBFS_DISK_DIRECT"
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,11 +26,37 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * The memory-mapped backend and direct I/O (see block_disk_open_flags()) are
+ * respectively used when the environment variables %BLOCK_DISK_MMAP_ENV and
+ * %BLOCK_DISK_DIRECT_ENV are set to a value other than "0".
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_flags - Open virtual disk file with a specific backend
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of %BLOCK_DISK_* open flags
+ *
+ * Same as block_disk_open(), but the backend is selected by @flags rather than
+ * by the environment. With %BLOCK_DISK_MMAP, the whole virtual disk file is
+ * mapped in memory: block_read() and block_write() become plain memory copies
+ * and the mapping is flushed back to the file by block_disk_close(). If the
+ * file cannot be mapped, the regular system-call backend is used instead.
+ *
+ * With %BLOCK_DISK_DIRECT, the system-call backend opens the file with O_DIRECT
+ * so that blocks are not cached a second time by the host. Transfers are then
+ * fastest from buffers obtained with block_buffer_alloc(); other buffers are
+ * bounced through such a buffer. If the host file system rejects O_DIRECT, the
+ * file is silently opened without it.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or is already open. 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +64,18 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Flush virtual disk file to stable storage
+ *
+ * Wait until every block written so far has reached the storage device holding
+ * the virtual disk file, flushing the mapping first with the memory-mapped
+ * backend.
+ *
+ * Return: -1 if there is no virtual disk file opened or if it cannot be
+ * flushed. 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -34,6 +84,35 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_map - Get base address of memory-mapped disk
+ *
+ * Block @n of the currently open disk lives at offset @n * %BLOCK_SIZE from the
+ * returned address, which stays valid until block_disk_close().
+ *
+ * Return: NULL if there was no virtual disk file opened or if it is not
+ * memory-mapped. The base address of the mapping otherwise.
+ */
+void *block_disk_map(void);
+
+/**
+ * block_buffer_alloc - Get a block buffer suitable for direct I/O
+ *
+ * Get a %BLOCK_SIZE buffer aligned on a page boundary, recycled from a pool of
+ * previously released buffers whenever possible.
+ *
+ * Return: NULL if no memory is available. The buffer otherwise.
+ */
+void *block_buffer_alloc(void);
+
+/**
+ * block_buffer_free - Release a block buffer
+ * @buf: Buffer obtained with block_buffer_alloc(), or NULL
+ *
+ * Give buffer @buf back to the pool of block buffers.
+ */
+void block_buffer_free(void *buf);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
@@ -60,5 +139,93 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @bufs: Array of @count data buffers, one per block
+ * @count: Number of consecutive blocks to write
+ *
+ * Write the content of the @count buffers of @bufs (%BLOCK_SIZE bytes each) in
+ * the virtual disk's blocks @block to @block + @count - 1, buffer @bufs[i]
+ * going to block @block + i. The buffers do not need to be contiguous in
+ * memory, but the blocks do: the whole range is transferred with as few
+ * system calls as possible.
+ *
+ * Return: -1 if any block of the range is out of bounds or inaccessible or if
+ * the writing operation fails. 0 otherwise.
+ */
+int block_writev(size_t block, const void *bufs[], size_t count);
+
+/**
+ * block_readv - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @bufs: Array of @count data buffers, one per block
+ * @count: Number of consecutive blocks to read
+ *
+ * Read the content of the virtual disk's blocks @block to @block + @count - 1
+ * (%BLOCK_SIZE bytes each) into the buffers of @bufs, buffer @bufs[i] receiving
+ * block @block + i. The buffers do not need to be contiguous in memory, but the
+ * blocks do: the whole range is transferred with as few system calls as
+ * possible.
+ *
+ * Return: -1 if any block of the range is out of bounds or inaccessible, or if
+ * the reading operation fails. 0 otherwise.
+ */
+int block_readv(size_t block, void *bufs[], size_t count);
+
+/**
+ * struct block_request - Asynchronous block transfer
+ * @block: Index of the first block of the transfer
+ * @count: Number of consecutive blocks to transfer
+ * @bufs: Array of @count data buffers, one per block (as for block_readv())
+ * @write: Non-zero to write @bufs to the disk, zero to read them from it
+ * @result: Set on completion: 0 if the transfer succeeded, -1 otherwise
+ *
+ * The remaining members are private to the block layer. A request, and the
+ * buffers it points to, must stay valid until block_reap() reports it
+ * complete.
+ */
+struct block_request {
+	size_t block;
+	size_t count;
+	void **bufs;
+	int write;
+	int result;
+
+	/* Private */
+	int done;
+	struct block_request *next;
+	void *priv;
+};
+
+/**
+ * block_submit - Queue asynchronous block transfers
+ * @reqs: Array of requests to queue
+ * @count: Number of requests in @reqs
+ *
+ * Start the @count transfers described by @reqs without waiting for them to
+ * complete, so that many of them can be in flight at the same time. On Linux,
+ * requests are handed to the kernel through io_uring; if io_uring is not
+ * available, they are served by a pool of worker threads instead.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the asynchronous
+ * engine cannot be started. 0 otherwise; failure of an individual transfer is
+ * reported in its @result once reaped.
+ */
+int block_submit(struct block_request *reqs, size_t count);
+
+/**
+ * block_reap - Collect completed asynchronous block transfers
+ * @reqs: Array of previously submitted requests
+ * @count: Number of requests in @reqs
+ * @wait: Non-zero to block until all of @reqs have completed
+ *
+ * Process pending completions and update the @result of every request of @reqs
+ * that has finished.
+ *
+ * Return: The number of requests of @reqs that have completed.
+ */
+size_t block_reap(struct block_request *reqs, size_t count, int wait);
+
 #endif /* _DISK_H */
 
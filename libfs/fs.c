@@ -1,26 +1,69 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+#include <time.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
+#include "journal.h"
 
 #define BLOCK_SIZE 4096
 
 #define SIGNATURE_LENGTH 8
 #define FILENAME_LENGTH 16
 
-#define SUPERBLOCK_PADDING 4079
-#define FILE_ENTRY_PADDING 10
+#define SUPERBLOCK_PADDING 4061
+#define FILE_ENTRY_PADDING 5
 
 #define FAT_EOC 0xFFFF
 #define FIRST_FAT_BLOCK_INDEX 1
 #define MAX_DATA_BLOCKS 8192
 
-#define FILE_NUM 32
+#define FILE_TABLE_MIN_ENTRIES 32
+#define FILE_TABLE_MAX_CHUNKS 26 // enough for INT_MAX descriptors
+
+#define JOURNAL_SIGNATURE 0x4c4e524a // "JRNL"
+#define JOURNAL_RECORD_FAT 1
+#define JOURNAL_RECORD_ROOT 2
+#define JOURNAL_RECORD_DIRECTORY 3
+#define JOURNAL_RECORD_ENTRY 4
+
+#define DIRECTORY_SIGNATURE 0x58524944 // "DIRX"
+#define DIRECTORY_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(struct file_entry))
+
+#define DIRECTORY_INDEX_EMPTY -1
+#define DIRECTORY_INDEX_REMOVED -2
+
+#define FILE_TYPE_REGULAR 0
+#define FILE_TYPE_DIRECTORY 1
+#define FILE_TYPE_INLINE 2
+
+#define INLINE_SIGNATURE 0x4e4c4e49 // "INLN"
+#define INLINE_ENTRY_BYTES (sizeof(struct file_entry) - 1)
+#define INLINE_MAX_ENTRIES 9 // enough for 256 bytes
+#define INLINE_MAX_SIZE (INLINE_MAX_ENTRIES * INLINE_ENTRY_BYTES)
+
+#define DENTRY_CACHE_BUCKETS 256
+
+#define INODE_TABLE_BUCKETS 256
+
+#define PREALLOCATION_MAX_BLOCKS 8
+
+#define BLOCK_MAP_MIN_BLOCKS 16
+
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 32
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 struct __attribute__ ((__packed__)) superblock {
 	uint64_t signature;
@@ -29,6 +72,12 @@ struct __attribute__ ((__packed__)) superblock {
 	uint16_t data_block_start_index;
 	uint16_t num_data_blocks;
 	uint8_t num_fat_blocks;
+	uint32_t journal_signature; // JOURNAL_SIGNATURE when the disk has a journal
+	uint16_t journal_start;     // FAT index of the first block of the journal
+	uint16_t journal_length;
+	uint32_t directory_signature; // DIRECTORY_SIGNATURE when the directory has extension blocks
+	uint16_t directory_start;     // FAT index of the first extension block
+	uint32_t inline_signature;    // INLINE_SIGNATURE when small files may be stored inline
 	uint8_t padding[SUPERBLOCK_PADDING];
 };
 
@@ -36,40 +85,410 @@ struct __attribute__ ((__packed__)) fat {
 	uint16_t num_entries; //equal to the num_data_blocks
 	uint16_t fat_free;
 	uint16_t *entries;
+	bool *dirty_blocks; // FAT blocks changed since they were last written
 };
 
 struct __attribute__ ((__packed__)) file_entry {
 	uint8_t filename[FILENAME_LENGTH];
 	uint32_t file_size;
 	uint16_t index_first_data_block;
+	uint8_t type; // FILE_TYPE_DIRECTORY for subdirectories, stored like files
+	uint32_t inline_entry; // first entry holding the data of FILE_TYPE_INLINE files
 	uint8_t padding[FILE_ENTRY_PADDING];
 };
 
-struct file_descriptor_entry {
+// Entry of a directory holding part of the data of a FILE_TYPE_INLINE file of
+// that directory. The first byte stays 0 so that lookups and listings skip the
+// entry, which the free entries of the directory do not include
+struct __attribute__ ((__packed__)) inline_entry {
+	uint8_t unused;
+	uint8_t data[INLINE_ENTRY_BYTES];
+};
+
+// In-core state of an open file, shared by all of its descriptors
+struct inode {
 	struct file_entry *file_entry;
+	struct directory *directory; // directory holding file_entry
+	int entry_idx;               // index of file_entry in that directory
+	int refcount;                // number of descriptors open on the file
+	pthread_rwlock_t lock;       // held shared by reads, exclusively by writes
+
+	// Blocks chained to the file and the last of them, so that appends do
+	// not walk the FAT chain
+	int num_blocks;              // -1 until the chain is first walked
+	int tail_fat_idx;            // FAT_EOC when the file has no block
+
+	// Free blocks right after the tail, which the next appends take first so
+	// that the file stays contiguous. They are only marked used in the
+	// free-space index, never in the FAT, and are given back once the file is
+	// closed or the disk is full. Under the metadata lock
+	int reserved_start;
+	int reserved_length;
+	bool reserving;              // in the list of inodes of the free-space index
+	struct inode *reserved_next;
+
+	// FAT index of each leading block of the file, built on the first random
+	// access through any descriptor and extended lazily as the file is
+	// accessed further. Reads add to it at once, under its own lock
+	pthread_mutex_t block_map_lock;
+	uint16_t *block_map;         // read without lock to tell whether it is built
+	int block_map_length;
+	int block_map_capacity;
+
+	// Small writes made through descriptors opened with FS_OPEN_BUFFERED,
+	// combined until the end of their block. They are written to the file
+	// before anything else reads it, writes it or gets its size
+	uint8_t *write_buffer;       // BLOCK_SIZE bytes, allocated on the first write
+	int write_buffer_offset;     // offset in the file of the first byte
+	int write_buffer_length;     // bytes waiting to be written, read without lock
+	bool write_buffer_failed;    // a flush failed, and later small writes fail too
+
+	struct inode *next;          // next inode in the same bucket of the inode table
+};
+
+struct file_descriptor_entry {
+	pthread_mutex_t lock; // held by calls using the descriptor
+	struct inode *inode;
 	int offset;
 	int fd;
 	bool is_open;
+	int next_free; // next descriptor of the free list while not open
+
+	// Sequential readahead state
+	int readahead_next;   // offset at which the next read is sequential
+	int readahead_window; // number of blocks read ahead, 0 on random access
+	int readahead_until;  // first block of the file not read ahead yet
+
+	// Where to allocate the next blocks of the file when it has none,
+	// seeded at open from the rotor of the free-space index
+	int allocation_goal;
+
+	// Last block of the file reached through the FAT chain, so that reads and
+	// writes going forward resume from it instead of the first block
+	int cursor_block;   // logical block in the file, -1 when not set
+	int cursor_fat_idx; // FAT index of that block
+
+	// Positional calls in progress on the descriptor, which work without its
+	// lock. fs_close() waits for them before letting go of the inode
+	int positional_calls;
+
+	// Arrays describing the blocks of a read or write, kept for the next ones
+	void **transfer_buffers;
+	struct block_request *transfer_requests;
+	size_t transfer_capacity; // number of blocks they have room for
+
+	// Small writes are combined in the buffer of the inode when opened with
+	// FS_OPEN_BUFFERED
+	bool buffered;
+};
+
+// Segments of the buffer of a read or write, walked from its start onwards
+struct transfer_cursor {
+	const struct iovec *iov;
+	int iovcnt;
+	int segment;          // segment holding the current position
+	size_t segment_start; // position of the start of the segment in the transfer
+};
+
+// Free-space index over the data blocks, kept in sync with the FAT
+struct free_space {
+	uint64_t *used_bitmap; // bit i set when data block i is allocated
+	uint64_t *full_bitmap; // bit w set when word w of used_bitmap is all ones
+	size_t num_words;
+	int rotor;             // block following the last allocated extent
+	struct inode *reserving; // inodes with blocks reserved, see struct inode
+};
+
+// Metadata changes not committed to the journal yet, when the disk has one.
+// Changed directory entries are tracked by their directory. Transactions are
+// numbered, changes going in the open one until a thread gathers them
+struct metadata_log {
+	uint64_t *dirty_fat_entries;                    // bit i set when FAT entry i changed
+	bool directory_start_changed;                   // directory extension was created
+	bool pending;                                   // some change is not committed
+	uint64_t open_sequence;                         // transaction gathering the changes
+	uint64_t durable_sequence;                      // last transaction committed
+	uint64_t failed_sequence;                       // last transaction that could not be
+	bool committing;                                // a thread is committing a transaction
+	long commit_delay_ms;                           // how long it waits for others to join
+	uint8_t *records;                               // where the records are gathered
+	size_t records_capacity;
+};
+
+// Journal records, logging the new value of a FAT entry, of a root directory
+// entry, of the start of the root directory extension or of a subdirectory entry
+struct __attribute__ ((__packed__)) fat_record {
+	uint8_t type;
+	uint16_t fat_idx;
+	uint16_t value;
+};
+
+struct __attribute__ ((__packed__)) root_record {
+	uint8_t type;
+	uint32_t entry_idx;
+	struct file_entry file_entry;
+};
+
+struct __attribute__ ((__packed__)) directory_record {
+	uint8_t type;
+	uint16_t directory_start;
+};
+
+struct __attribute__ ((__packed__)) entry_record {
+	uint8_t type;
+	uint16_t fat_idx; // block of the subdirectory holding the entry
+	uint8_t slot;     // entry within the block
+	struct file_entry file_entry;
+};
+
+// Slot of a directory index. Lookups read slots without lock: a slot is filled
+// once, its filename before its entry, and keeps its filename when the entry
+// is removed from the index
+struct directory_slot {
+	int32_t entry_idx; // DIRECTORY_INDEX_EMPTY, DIRECTORY_INDEX_REMOVED or the entry
+	bool is_directory;
+	char filename[FILENAME_LENGTH];
+};
+
+// Index mapping filenames to entries, open addressing with linear probing.
+// It is replaced by a new one when it needs more room, and freed once the
+// lookups reading it are over
+struct directory_index {
+	size_t num_slots; // power of two, at least twice the number of entries
+	size_t num_used;  // slots filled, including those of removed entries
+	struct directory_slot slots[];
+};
+
+// Directory, either the root directory or a subdirectory. The root directory
+// is the root directory block, followed by a chain of extension blocks in the
+// data area once it holds more than FS_FILE_MAX_COUNT files. Subdirectories
+// are files holding entries, whose entry in the parent is FILE_TYPE_DIRECTORY
+struct directory {
+	struct file_entry **blocks; // DIRECTORY_BLOCK_ENTRIES entries each, never moved. The
+	                            // array is replaced like the index when it grows
+	uint16_t *block_fat_idx;    // FAT index of each block (except the root directory block)
+	bool *dirty_blocks;         // blocks changed since they were last written
+	uint64_t *logged_entries;   // bit i set when entry i changed since the last journal commit
+	int num_blocks;
+	int num_entries;
+	int num_files;
+
+	// Index mapping filenames to entries
+	struct directory_index *index;
+	uint64_t *free_entries;     // bit i set when entry i is unused
+
+	// Entry of the subdirectory in its parent, NULL for the root directory
+	struct directory *parent;
+	int parent_entry_idx;
+	struct directory *dentry_next; // next subdirectory in the same dentry cache bucket
 };
 
 typedef struct superblock *superblock_t;
 typedef struct fat *fat_t;
+typedef struct free_space *free_space_t;
+typedef struct metadata_log *metadata_log_t;
+typedef struct directory *directory_t;
 typedef struct file_entry *file_entry_t;
+typedef struct inode *inode_t;
 typedef struct file_descriptor_entry *file_descriptor_entry_t;
 
 superblock_t superblock;
 fat_t fat;
-file_entry_t root_directory; //will be an array of size 128 though, each of size 32
-file_descriptor_entry_t *file_descriptor_table;
-
-uint8_t num_files_open;
-uint8_t num_files_total;
+free_space_t free_space;
+metadata_log_t metadata_log;
+directory_t root_directory;
+directory_t dentry_cache[DENTRY_CACHE_BUCKETS]; // subdirectories loaded in memory, looked up without lock
+inode_t inode_table[INODE_TABLE_BUCKETS];       // files with open descriptors
+uint64_t namespace_generation; // bumped whenever files or directories are deleted
+file_descriptor_entry_t file_descriptor_chunks[FILE_TABLE_MAX_CHUNKS]; // chunk c holds FILE_TABLE_MIN_ENTRIES << c descriptors
+int file_descriptor_num_chunks;
+int file_descriptor_table_size; // read without the table lock, once the chunks are set up
+int file_descriptor_limit;
+int free_file_descriptor; // head of the free list, -1 when every descriptor is open
+
+bool superblock_dirty;
+
+int num_files_open;
+int num_write_buffers_pending; // inodes with small writes waiting to be flushed
 bool disk_open;
 
+// Every call on the mounted disk runs inside an epoch (see epoch_enter()),
+// which keeps the disk mounted and the memory it reads from being freed until
+// it returns. Locks are always taken in this order by a thread holding
+// several of them:
+// - the mount lock, serializing fs_mount() and fs_umount()
+// - the lock of a file descriptor, held by the call using it
+// - the lock of an inode, held shared by reads and exclusively by writes
+// - the namespace lock, over the entries, blocks and index of the directories.
+//   It is held shared to walk the directories that changes must not move, and
+//   exclusively to add, remove or move entries. Lookups of files in the
+//   directory indexes, and of the directories in the dentry cache, do not
+//   take it: changes publish new versions of what lookups read
+// - the lock of a bucket of the inode table, over the inodes of the bucket
+//   and their reference counts
+// - the metadata lock, over the FAT, the free-space index, the dirty and
+//   logged state of the metadata and the sizes of open files. The thread
+//   committing a transaction writes it to the journal without it, unless the
+//   journal is emptied afterwards. Subdirectories are loaded with it held
+// - the dentry cache lock, over the list of loaded subdirectories
+// - the file descriptor table lock, over the free list and the table size
+// - the epoch lock, over the epoch records and the memory waiting to be freed
+// - the block map lock of an inode, over its block map
+pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t inode_table_locks[INODE_TABLE_BUCKETS] = { [0 ... INODE_TABLE_BUCKETS - 1] = PTHREAD_MUTEX_INITIALIZER };
+pthread_mutex_t metadata_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t metadata_log_committed = PTHREAD_COND_INITIALIZER; // signaled with the metadata lock
+pthread_mutex_t dentry_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t file_descriptor_table_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Epoch-based reclamation. Memory that calls may still be reading once it is
+// no longer reachable is retired with the current epoch instead of freed, and
+// only freed once every call in progress entered after that epoch
+struct epoch_record {
+	uint64_t epoch;            // epoch at which the call of the thread started, 0 outside of calls
+	int depth;                 // number of nested calls of the thread
+	bool in_use;               // owned by a thread
+	struct epoch_record *next;
+};
+
+struct epoch_retired {
+	void *ptr;
+	void (*release)(void *ptr);
+	uint64_t epoch;            // epoch at which ptr was retired
+	struct epoch_retired *next;
+};
+
+uint64_t global_epoch = 1;
+struct epoch_record *epoch_records;   // records of all the threads, never freed
+struct epoch_retired *epoch_retired;  // memory waiting to be freed
+pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t epoch_key;              // gives the record of a thread back when it exits
+__thread struct epoch_record *epoch_self;
+
+void epoch_record_release(void *record) {
+	__atomic_store_n(&((struct epoch_record *) record)->in_use, false, __ATOMIC_RELEASE);
+}
+
+void epoch_key_create() {
+	pthread_key_create(&epoch_key, epoch_record_release);
+}
+
+struct epoch_record *epoch_record() {
+	// Threads take a record left by a thread that exited, or add one
+	if (epoch_self != NULL) {
+		return epoch_self;
+	}
+	pthread_once(&epoch_key_once, epoch_key_create);
+	pthread_mutex_lock(&epoch_lock);
+	struct epoch_record *record = epoch_records;
+	while (record != NULL && __atomic_load_n(&record->in_use, __ATOMIC_ACQUIRE)) {
+		record = record->next;
+	}
+	if (record == NULL) {
+		record = calloc(1, sizeof(struct epoch_record));
+		if (record == NULL) {
+			pthread_mutex_unlock(&epoch_lock);
+			return NULL;
+		}
+		record->next = epoch_records;
+		__atomic_store_n(&epoch_records, record, __ATOMIC_RELEASE);
+	}
+	record->in_use = true;
+	pthread_mutex_unlock(&epoch_lock);
+	pthread_setspecific(epoch_key, record);
+	epoch_self = record;
+	return record;
+}
+
+bool epoch_enter() {
+	// Publish the epoch before reading anything it protects
+	struct epoch_record *record = epoch_record();
+	if (record == NULL) {
+		return false;
+	}
+	if (record->depth++ == 0) {
+		__atomic_store_n(&record->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return true;
+}
+
+void epoch_exit() {
+	if (--epoch_self->depth == 0) {
+		__atomic_store_n(&epoch_self->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+uint64_t epoch_oldest() {
+	// Oldest epoch at which a call in progress started, UINT64_MAX if none
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t oldest = UINT64_MAX;
+	for (struct epoch_record *record = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE);
+		record != NULL;
+		record = record->next) {
+		uint64_t epoch = __atomic_load_n(&record->epoch, __ATOMIC_ACQUIRE);
+		if (epoch != 0 && record != epoch_self) {
+			oldest = MIN(oldest, epoch);
+		}
+	}
+	return oldest;
+}
+
+void epoch_reclaim() {
+	// Free what was retired before the oldest call in progress started
+	pthread_mutex_lock(&epoch_lock);
+	uint64_t oldest = epoch_oldest();
+	struct epoch_retired **link = &epoch_retired;
+	while (*link != NULL) {
+		struct epoch_retired *retired = *link;
+		if (retired->epoch < oldest) {
+			*link = retired->next;
+			retired->release(retired->ptr);
+			free(retired);
+		} else {
+			link = &retired->next;
+		}
+	}
+	pthread_mutex_unlock(&epoch_lock);
+}
+
+void epoch_synchronize() {
+	// Wait until every other call that started before now has returned
+	uint64_t epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+	while (epoch_oldest() <= epoch) {
+		sched_yield();
+	}
+}
+
+void epoch_retire(void *ptr, void (*release)(void *ptr)) {
+	// Calls that start from now on cannot reach ptr any more, the others may
+	struct epoch_retired *retired = malloc(sizeof(struct epoch_retired));
+	if (retired == NULL) {
+		epoch_synchronize();
+		release(ptr);
+		return;
+	}
+	retired->ptr = ptr;
+	retired->release = release;
+	pthread_mutex_lock(&epoch_lock);
+	retired->epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+	retired->next = epoch_retired;
+	epoch_retired = retired;
+	pthread_mutex_unlock(&epoch_lock);
+	epoch_reclaim();
+}
+
 bool validate_superblock() {
-	// Validate signature of superblock
+	// Validate signature of superblock. Disks storing files inline have one of
+	// their own, that other implementations refuse rather than overwriting the
+	// entries holding the data, which they would see as unused
 	uint8_t signature_array[] = {'E','C','S','1','5','0','F','S'};
-	if (memcmp(&(superblock->signature), signature_array, SIGNATURE_LENGTH) != 0) {
+	uint8_t inline_signature_array[] = {'E','C','S','1','5','0','F','I'};
+	if (memcmp(&(superblock->signature), signature_array, SIGNATURE_LENGTH) != 0
+		&& (superblock->inline_signature != INLINE_SIGNATURE
+			|| memcmp(&(superblock->signature), inline_signature_array, SIGNATURE_LENGTH) != 0)) {
 		printf("mismatched signatures!\n");
 		return false;
 	}
@@ -79,6 +498,21 @@ bool validate_superblock() {
 		return false;
 	}
 
+	// Validate the location of the journal, if any
+	if (superblock->journal_signature == JOURNAL_SIGNATURE
+		&& (superblock->journal_start == 0
+			|| superblock->journal_length < 2
+			|| superblock->journal_start + superblock->journal_length > superblock->num_data_blocks)) {
+		return false;
+	}
+
+	// Validate the location of the directory extension, if any
+	if (superblock->directory_signature == DIRECTORY_SIGNATURE
+		&& (superblock->directory_start == 0
+			|| superblock->directory_start >= superblock->num_data_blocks)) {
+		return false;
+	}
+
 	// Validate block count for superblock
 	int expected_block_count_from_manual_calculation = superblock->num_data_blocks + superblock->num_fat_blocks + 2;
 	int disk_block_count = block_disk_count();
@@ -104,9 +538,10 @@ int initialize_fat() {
 	fat->num_entries = superblock->num_data_blocks;
 	fat->fat_free = superblock->num_data_blocks - 1;
 	fat->entries = malloc(MAX_DATA_BLOCKS * sizeof(uint16_t));
+	fat->dirty_blocks = calloc(superblock->num_fat_blocks, sizeof(bool));
 
 	// Handle case where malloc fails
-	if (fat->entries == NULL) {
+	if (fat->entries == NULL || fat->dirty_blocks == NULL) {
 		return -1;
 	}
 
@@ -125,637 +560,3151 @@ int initialize_fat() {
 	return 0;
 }
 
-bool validate_fat() {
-	// Validate that first fat entry is FAT_EOC
-	if (fat->entries[0] != FAT_EOC) {
-		printf("the first fat entry should be 0xFFFF, instead its %x\n", fat->entries[0]);
-		return false;
-	}
-
-	return true;
+void metadata_log_start() {
+	metadata_log->pending = true;
 }
 
-int initialize_file_descriptor_table() {
-	for (int fd = 0; fd < FILE_NUM; fd++) {
-		file_descriptor_entry_t file_descriptor_entry = malloc(sizeof(struct file_descriptor_entry));
-		if (file_descriptor_entry == NULL) {
-			return -1;
-		}
-
-		file_descriptor_entry->file_entry = NULL;
-		file_descriptor_entry->offset = 0;
-		file_descriptor_entry->fd = fd;
-		file_descriptor_entry->is_open = false;
+void metadata_log_mark(uint64_t *bitmap, int idx) {
+	metadata_log_start();
+	bitmap[idx / 64] |= (uint64_t)1 << (idx % 64);
+}
 
-		file_descriptor_table[fd] = file_descriptor_entry;
+void fat_set_entry(int fat_idx, uint16_t value) {
+	// Remember which FAT block needs to be written back
+	fat->entries[fat_idx] = value;
+	fat->dirty_blocks[fat_idx / (BLOCK_SIZE / sizeof(uint16_t))] = true;
+	if (metadata_log != NULL) {
+		metadata_log_mark(metadata_log->dirty_fat_entries, fat_idx);
 	}
-
-	return 0;
 }
 
-int fs_mount(const char *diskname)
-{
-	// Handle case where disk is already open
-	if (disk_open) {
-		return -1;
-	}
+file_entry_t directory_entry(directory_t dir, int entry_idx) {
+	struct file_entry **blocks = __atomic_load_n(&dir->blocks, __ATOMIC_ACQUIRE);
+	return &blocks[entry_idx / DIRECTORY_BLOCK_ENTRIES][entry_idx % DIRECTORY_BLOCK_ENTRIES];
+}
 
-	// Handle case where opening disk fails
-	if (block_disk_open(diskname) == -1) {
-		return -1;
+size_t directory_disk_block(directory_t dir, int block) {
+	if (dir == root_directory && block == 0) {
+		return superblock->root_directory_block_index;
 	}
+	return dir->block_fat_idx[block] + superblock->data_block_start_index;
+}
 
-	// Allocate memory for the superblock, fat, and root directory
-	superblock = malloc(sizeof(struct superblock));
-	fat = malloc(sizeof(struct fat));
-	root_directory = malloc(FS_FILE_MAX_COUNT * sizeof(struct file_entry));
-	file_descriptor_table = malloc(FILE_NUM * sizeof(struct file_descriptor_entry));
-	if (superblock == NULL
-		|| fat == NULL
-		|| root_directory == NULL
-		|| file_descriptor_table == NULL) {
-		return -1;
+void directory_mark_dirty(directory_t dir, int entry_idx) {
+	dir->dirty_blocks[entry_idx / DIRECTORY_BLOCK_ENTRIES] = true;
+	if (metadata_log != NULL) {
+		metadata_log_mark(dir->logged_entries, entry_idx);
 	}
+}
 
-	// Mark disk as open and set number of open files to 0
-	disk_open = true;
-	num_files_open = 0;
-
-	// Read superblock from disk
-	block_read(0, superblock);
+size_t dentry_cache_bucket(directory_t parent, int entry_idx) {
+	return ((uintptr_t)parent / sizeof(struct directory) * 31 + entry_idx) % DENTRY_CACHE_BUCKETS;
+}
 
-	// Validate data members for superblock
-	if (!validate_superblock()) {
-		return -1;
+directory_t next_loaded_directory(directory_t dir) {
+	// The root directory comes first, then the subdirectories of the dentry cache
+	size_t bucket = 0;
+	if (dir == NULL) {
+		return root_directory;
+	} else if (dir->dentry_next != NULL) {
+		return dir->dentry_next;
+	} else if (dir != root_directory) {
+		bucket = dentry_cache_bucket(dir->parent, dir->parent_entry_idx) + 1;
 	}
-
-	// Initialize data members for fat
-	if (initialize_fat() == -1) {
-		return -1;
+	while (bucket < DENTRY_CACHE_BUCKETS && dentry_cache[bucket] == NULL) {
+		bucket++;
 	}
+	return bucket < DENTRY_CACHE_BUCKETS ? dentry_cache[bucket] : NULL;
+}
 
-	// Validate data members for fat
-	if (!validate_fat()) {
-		return -1;
+void directory_set_start(uint16_t fat_idx) {
+	superblock->directory_signature = DIRECTORY_SIGNATURE;
+	superblock->directory_start = fat_idx;
+	superblock_dirty = true;
+	if (metadata_log != NULL) {
+		metadata_log_start();
+		metadata_log->directory_start_changed = true;
 	}
+}
 
-	// Read root directory from disk
-	block_read(superblock->root_directory_block_index, root_directory);
+int write_dirty_metadata() {
+	// Write back the changed FAT blocks, consecutive ones with a single call
+	int fat_block = 0;
+	while (fat_block < superblock->num_fat_blocks) {
+		if (!fat->dirty_blocks[fat_block]) {
+			fat_block++;
+			continue;
+		}
 
-	// Determine the number of files in the root directory
-	num_files_total = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root_directory[i].filename[0] != 0) {
-			num_files_total++;
+		const void *block_buffers[superblock->num_fat_blocks];
+		size_t num_blocks = 0;
+		while (fat_block + num_blocks < superblock->num_fat_blocks
+			&& fat->dirty_blocks[fat_block + num_blocks]) {
+			block_buffers[num_blocks] = (uint8_t*) fat->entries + (fat_block + num_blocks) * BLOCK_SIZE;
+			num_blocks++;
+		}
+		if (block_writev(fat_block + FIRST_FAT_BLOCK_INDEX, block_buffers, num_blocks) == -1) {
+			return -1;
 		}
+		memset(&fat->dirty_blocks[fat_block], 0, num_blocks * sizeof(bool));
+		fat_block += num_blocks;
 	}
 
-	// Initialize file_descriptors_table
-	if (initialize_file_descriptor_table() == -1) {
-		return -1;
+	// Write back the directory blocks that changed
+	int ret = 0;
+	pthread_mutex_lock(&dentry_cache_lock);
+	for (directory_t dir = next_loaded_directory(NULL); dir != NULL && ret == 0; dir = next_loaded_directory(dir)) {
+		for (int block = 0; block < dir->num_blocks && ret == 0; block++) {
+			if (!dir->dirty_blocks[block]) {
+				continue;
+			}
+			ret = block_write(directory_disk_block(dir, block), dir->blocks[block]);
+			dir->dirty_blocks[block] = ret == -1;
+		}
 	}
-
-	return 0;
-}
-
-int fs_umount(void)
-{
-	// Ensure disk is open
-	if (!disk_open || num_files_open) {
+	pthread_mutex_unlock(&dentry_cache_lock);
+	if (ret == -1) {
 		return -1;
 	}
 
-	// Write all FAT entries to disk
-	for (int i = 0; i < superblock->num_fat_blocks; i++) {
-		if (block_write(i + 1, (u_int8_t*) fat->entries + (i * BLOCK_SIZE)) == -1) {
+	// Point the superblock to the directory extension once it is on disk
+	if (superblock_dirty) {
+		if (block_write(0, superblock) == -1) {
 			return -1;
 		}
+		superblock_dirty = false;
 	}
 
-	// Write Root Directory to disk
-	if (block_write(superblock->root_directory_block_index, root_directory) == -1) {
-		return -1;
-	}
+	return 0;
+}
 
-	// Close disk
-	if (block_disk_close() == -1) {
-		return -1;
+void free_space_mark(int fat_idx, bool used) {
+	size_t word = fat_idx / 64;
+	uint64_t bit = (uint64_t)1 << (fat_idx % 64);
+	if (used) {
+		free_space->used_bitmap[word] |= bit;
+	} else {
+		free_space->used_bitmap[word] &= ~bit;
 	}
 
-	// Free local disk data members
-	free(superblock);
-	free(fat);
-	free(root_directory);
-	for (int i = 0; i < FILE_NUM; i++) {
-		free(file_descriptor_table[i]);
+	// Keep the summary level in sync with the word
+	uint64_t full_bit = (uint64_t)1 << (word % 64);
+	if (free_space->used_bitmap[word] == UINT64_MAX) {
+		free_space->full_bitmap[word / 64] |= full_bit;
+	} else {
+		free_space->full_bitmap[word / 64] &= ~full_bit;
 	}
-	free(file_descriptor_table);
-
-	// Mark disc as closed
-	disk_open = false;
-	return 0;
 }
 
-int fs_info(void)
-{
-	if (!disk_open) {
+int initialize_free_space() {
+	// One bit per FAT entry, plus one summary bit per 64 entries
+	free_space->num_words = (superblock->num_data_blocks + 63) / 64;
+	size_t num_full_words = (free_space->num_words + 63) / 64;
+	free_space->used_bitmap = calloc(free_space->num_words, sizeof(uint64_t));
+	free_space->full_bitmap = calloc(num_full_words, sizeof(uint64_t));
+	if (free_space->used_bitmap == NULL || free_space->full_bitmap == NULL) {
 		return -1;
 	}
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", block_disk_count());
-	printf("fat_blk_count=%d\n", superblock->num_fat_blocks);
-	printf("rdir_blk=%d\n", superblock->num_fat_blocks+1);
-	printf("data_blk=%d\n", superblock->num_fat_blocks+2);
-	printf("data_blk_count=%d\n", superblock->num_data_blocks);
-	printf("fat_free_ratio=%d/%d\n", fat->fat_free, superblock->num_data_blocks);
-	printf("rdir_free_ratio=%d/%d\n", 128-num_files_total, 128);
+	free_space->rotor = 0;
+	free_space->reserving = NULL;
+
+	// Entries past the end of the FAT can never be allocated
+	for (size_t word = free_space->num_words; word < num_full_words * 64; word++) {
+		free_space->full_bitmap[word / 64] |= (uint64_t)1 << (word % 64);
+	}
+	for (int i = 0; i < (int)free_space->num_words * 64; i++) {
+		if (i >= superblock->num_data_blocks || fat->entries[i] != 0) {
+			free_space_mark(i, true);
+		}
+	}
 
 	return 0;
 }
 
-bool validate_filename(const char *filename) {
-	// Filename can't be null
-	if (filename == NULL) {
-		return false;
-	}
-
-	// Filename can't be empty
-	if (filename[0] == '\0') {
-		return false;
-	}
+bool free_space_is_free(int fat_idx) {
+	return !(free_space->used_bitmap[fat_idx / 64] & ((uint64_t)1 << (fat_idx % 64)));
+}
 
-	// Filename must contain null terminator in first 16 bytes
-	bool filename_contains_null_terminator = false;
-	for (int i = 0; i < FS_FILENAME_LEN; i++) {
-		if (filename[i] == '\0') {
-			filename_contains_null_terminator = true;
+int free_space_next_free(int fat_idx) {
+	// Look at the rest of the word first, then skip full words with the summary level
+	size_t word = fat_idx / 64;
+	uint64_t free_bits = ~free_space->used_bitmap[word] & (UINT64_MAX << (fat_idx % 64));
+	while (free_bits == 0) {
+		word++;
+		while (word < free_space->num_words
+			&& (free_space->full_bitmap[word / 64] >> (word % 64)) & 1) {
+			word++;
+		}
+		if (word >= free_space->num_words) {
+			return -1;
 		}
+		free_bits = ~free_space->used_bitmap[word];
 	}
+	return word * 64 + __builtin_ctzll(free_bits);
+}
 
-	if (!filename_contains_null_terminator) {
-		return false;
+int free_space_run_length(int fat_idx, int max_length) {
+	int length = 0;
+	while (length < max_length
+		&& fat_idx + length < superblock->num_data_blocks
+		&& free_space_is_free(fat_idx + length)) {
+		length++;
 	}
+	return length;
+}
 
-	// Filename cannot be longer than 16 bytes
-	if (strlen(filename) > FS_FILENAME_LEN) {
-		return false;
+int free_space_find_run(int from, int until, int length) {
+	// First free run of at least length blocks starting in [from, until)
+	int fat_idx = free_space_next_free(from);
+	while (fat_idx != -1 && fat_idx < until) {
+		int run_length = free_space_run_length(fat_idx, length);
+		if (run_length == length) {
+			return fat_idx;
+		}
+		fat_idx = fat_idx + run_length < superblock->num_data_blocks
+			? free_space_next_free(fat_idx + run_length)
+			: -1;
 	}
+	return -1;
+}
 
-	return true;
+void free_space_reserve(struct inode *inode, int start, int length) {
+	inode->reserved_start = start;
+	inode->reserved_length = length;
+	if (!inode->reserving) {
+		inode->reserving = true;
+		inode->reserved_next = free_space->reserving;
+		free_space->reserving = inode;
+	}
 }
 
-bool file_exists_in_root_directory(const char *filename) {
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		char *current_file = (char *) root_directory[i].filename;
-		if(strcmp(current_file, filename) == 0) {
-			return true;
+void free_space_unreserve(struct inode *inode) {
+	// Give the blocks reserved for the file back, and forget about it
+	for (int i = 0; i < inode->reserved_length; i++) {
+		free_space_mark(inode->reserved_start + i, false);
+	}
+	inode->reserved_length = 0;
+	if (inode->reserving) {
+		struct inode **link = &free_space->reserving;
+		while (*link != inode) {
+			link = &(*link)->reserved_next;
 		}
+		*link = inode->reserved_next;
+		inode->reserving = false;
 	}
-	return false;
 }
 
-bool validate_file_creation(const char *filename)
-{
-	// Validate filename
-	if (!validate_filename(filename)) {
-		return false;
+bool free_space_reclaim() {
+	// Blocks reserved for files go to whoever needs them once the disk is full
+	bool reclaimed = false;
+	while (free_space->reserving != NULL) {
+		reclaimed |= free_space->reserving->reserved_length > 0;
+		free_space_unreserve(free_space->reserving);
 	}
+	return reclaimed;
+}
 
-	// Root directory must have enough space for new file
-	int num_files_in_root_directory = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root_directory[i].filename[0] != '\0') {
-			num_files_in_root_directory++;
+int free_space_allocate_extent(int goal, int wanted, int *allocated) {
+	if (goal < 0 || goal >= superblock->num_data_blocks) {
+		goal = 0;
+	}
+
+	// Right at the goal (e.g. next to the tail of the file), even if it's short;
+	// otherwise the first run that holds the whole extent, searching from the
+	// goal onwards then wrapping around; otherwise the first free block
+	int start = -1;
+	if (free_space_is_free(goal)) {
+		start = goal;
+	} else {
+		start = free_space_find_run(goal, superblock->num_data_blocks, wanted);
+		if (start == -1) {
+			start = free_space_find_run(0, goal, wanted);
+		}
+		if (start == -1) {
+			start = free_space_next_free(goal);
+		}
+		if (start == -1) {
+			start = free_space_next_free(0);
+		}
+		if (start == -1) {
+			return free_space_reclaim() ? free_space_allocate_extent(goal, wanted, allocated) : -1;
 		}
 	}
 
-	if (num_files_in_root_directory == FS_FILE_MAX_COUNT) {
-		return false;
+	*allocated = free_space_run_length(start, wanted);
+	for (int i = 0; i < *allocated; i++) {
+		free_space_mark(start + i, true);
 	}
+	__atomic_store_n(&free_space->rotor, start + *allocated, __ATOMIC_RELAXED);
+	return start;
+}
 
-	// File should not already exists
-	if (file_exists_in_root_directory(filename)) {
-		return false;
-	}
+void free_space_release(int fat_idx) {
+	free_space_mark(fat_idx, false);
+}
 
-    return true;
+size_t directory_index_home(struct directory_index *index, const char *filename) {
+	// FNV-1a over the filename, which is at most FILENAME_LENGTH bytes
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < FILENAME_LENGTH && filename[i] != '\0'; i++) {
+		hash = (hash ^ (uint8_t)filename[i]) * 16777619u;
+	}
+	return hash & (index->num_slots - 1);
 }
 
-bool validate_file_deletion(const char *filename) {
-	// Validate filename
-	if (!validate_filename(filename)) {
-		return false;
+int directory_lookup(directory_t dir, const char *filename, bool *is_directory) {
+	// Probe from the home slot of the filename until an empty slot, without
+	// lock as the slots only change once they are published
+	struct directory_index *index = __atomic_load_n(&dir->index, __ATOMIC_ACQUIRE);
+	for (size_t slot = directory_index_home(index, filename); ; slot = (slot + 1) & (index->num_slots - 1)) {
+		struct directory_slot *directory_slot = &index->slots[slot];
+		int entry_idx = __atomic_load_n(&directory_slot->entry_idx, __ATOMIC_ACQUIRE);
+		if (entry_idx == DIRECTORY_INDEX_EMPTY) {
+			return -1;
+		}
+		if (entry_idx != DIRECTORY_INDEX_REMOVED
+			&& strncmp(directory_slot->filename, filename, FILENAME_LENGTH) == 0) {
+			if (is_directory != NULL) {
+				*is_directory = directory_slot->is_directory;
+			}
+			return entry_idx;
+		}
 	}
+}
 
-	// File must exists in root directory
-	if (!file_exists_in_root_directory(filename)) {
-		return false;
+void directory_index_place(struct directory_index *index, int entry_idx, const char *filename, bool is_directory) {
+	size_t slot = directory_index_home(index, filename);
+	while (index->slots[slot].entry_idx != DIRECTORY_INDEX_EMPTY) {
+		slot = (slot + 1) & (index->num_slots - 1);
 	}
+	struct directory_slot *directory_slot = &index->slots[slot];
+	memcpy(directory_slot->filename, filename, FILENAME_LENGTH);
+	directory_slot->is_directory = is_directory;
+	__atomic_store_n(&directory_slot->entry_idx, entry_idx, __ATOMIC_RELEASE);
+	index->num_used++;
+}
 
-	return true;
+void directory_index_insert(directory_t dir, int entry_idx) {
+	// The index has room, see directory_index_resize()
+	file_entry_t file_entry = directory_entry(dir, entry_idx);
+	directory_index_place(dir->index, entry_idx, (char *) file_entry->filename,
+		file_entry->type == FILE_TYPE_DIRECTORY);
+	dir->free_entries[entry_idx / 64] &= ~((uint64_t)1 << (entry_idx % 64));
 }
 
-bool validate_file_opening(const char *filename) {
-	// Validate filename
-	if (!validate_filename(filename)) {
-		return false;
+void directory_index_remove(directory_t dir, int entry_idx) {
+	// Entries leave their slot filled, as lookups may be probing past it
+	struct directory_index *index = dir->index;
+	size_t slot = directory_index_home(index, (char *) directory_entry(dir, entry_idx)->filename);
+	while (index->slots[slot].entry_idx != entry_idx) {
+		slot = (slot + 1) & (index->num_slots - 1);
 	}
+	__atomic_store_n(&index->slots[slot].entry_idx, DIRECTORY_INDEX_REMOVED, __ATOMIC_RELEASE);
+	dir->free_entries[entry_idx / 64] |= (uint64_t)1 << (entry_idx % 64);
+}
 
-	// File must exist in root directory
-	if (!file_exists_in_root_directory(filename)) {
-		return false;
+int directory_free_entry(directory_t dir) {
+	// Lowest unused entry, as the entries are listed in order
+	for (int word = 0; word < dir->num_entries / 64; word++) {
+		if (dir->free_entries[word] != 0) {
+			return word * 64 + __builtin_ctzll(dir->free_entries[word]);
+		}
 	}
+	return -1;
+}
 
-	// File descriptor must be available
-	file_descriptor_entry_t free_file_descriptor_entry = NULL;
-	for (int i = 0; i < FILE_NUM; i++) {
-		if (!file_descriptor_table[i]->is_open) {
-			free_file_descriptor_entry = file_descriptor_table[i];
-			break;
+int directory_index_resize(directory_t dir) {
+	// Keep the index at most half full, counting the slots of removed entries,
+	// with room for one more entry. Otherwise publish a new one holding the
+	// entries of the old one, which lookups may still be reading
+	struct directory_index *old_index = dir->index;
+	if (old_index != NULL
+		&& old_index->num_slots >= 2 * (size_t)dir->num_entries
+		&& (old_index->num_used + 1) * 2 <= old_index->num_slots) {
+		return 0;
+	}
+	size_t num_slots = 2;
+	while (num_slots < 2 * (size_t)dir->num_entries) {
+		num_slots *= 2;
+	}
+	struct directory_index *index = malloc(sizeof(struct directory_index) + num_slots * sizeof(struct directory_slot));
+	if (index == NULL) {
+		return -1;
+	}
+	index->num_slots = num_slots;
+	index->num_used = 0;
+	for (size_t slot = 0; slot < num_slots; slot++) {
+		index->slots[slot].entry_idx = DIRECTORY_INDEX_EMPTY;
+	}
+	for (size_t slot = 0; old_index != NULL && slot < old_index->num_slots; slot++) {
+		struct directory_slot *directory_slot = &old_index->slots[slot];
+		if (directory_slot->entry_idx >= 0) {
+			directory_index_place(index, directory_slot->entry_idx, directory_slot->filename,
+				directory_slot->is_directory);
 		}
 	}
-
-	if (free_file_descriptor_entry == NULL) {
-		return false;
+	__atomic_store_n(&dir->index, index, __ATOMIC_RELEASE);
+	if (old_index != NULL) {
+		epoch_retire(old_index, free);
 	}
+	return 0;
+}
 
-	return true;
+int inline_entries(size_t size) {
+	return (size + INLINE_ENTRY_BYTES - 1) / INLINE_ENTRY_BYTES;
 }
 
-int fs_create(const char *filename)
-{
-	// Check if disk is open
-	if (!disk_open) {
-		return -1;
+bool directory_reserve_entries(directory_t dir, int first, int count) {
+	// Entries can only be taken if they are all unused
+	if (first < 0 || first + count > dir->num_entries) {
+		return false;
 	}
-
-	// Check if filename is valid for creation
-	if (!validate_file_creation(filename)) {
-		return -1;
+	for (int i = first; i < first + count; i++) {
+		if (!(dir->free_entries[i / 64] & ((uint64_t)1 << (i % 64)))) {
+			return false;
+		}
 	}
+	for (int i = first; i < first + count; i++) {
+		dir->free_entries[i / 64] &= ~((uint64_t)1 << (i % 64));
+	}
+	return true;
+}
 
-	// Create empty file entry in root_directory
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root_directory[i].filename[0] != 0) {
+int directory_free_run(directory_t dir, int count) {
+	// Lowest run of count unused entries, skipping the words without any
+	int run_length = 0;
+	for (int i = 0; i < dir->num_entries; i++) {
+		if (i % 64 == 0 && dir->free_entries[i / 64] == 0) {
+			run_length = 0;
+			i += 63;
 			continue;
 		}
-
-		strcpy(root_directory[i].filename, filename);
-		root_directory[i].file_size = 0;
-		root_directory[i].index_first_data_block = FAT_EOC;
-		num_files_total++;
-		return 0;
+		run_length = dir->free_entries[i / 64] & ((uint64_t)1 << (i % 64)) ? run_length + 1 : 0;
+		if (run_length == count) {
+			return i - count + 1;
+		}
 	}
-
-	// If no file created, return error status
 	return -1;
 }
 
-int fs_delete(const char *filename)
-{
-	// Check if disk is open
-	if (!disk_open) {
-		return -1;
+void directory_release_entries(directory_t dir, int first, int count) {
+	for (int i = first; i < first + count; i++) {
+		memset(directory_entry(dir, i), 0, sizeof(struct file_entry));
+		dir->free_entries[i / 64] |= (uint64_t)1 << (i % 64);
+		directory_mark_dirty(dir, i);
 	}
+}
 
+int directory_index_build(directory_t dir) {
+	if (directory_index_resize(dir) == -1) {
+		return -1;
+	}
+
+	// Index the files of the directory, and count them. The entries holding
+	// the data of inline files are in use as well
+	dir->num_files = 0;
+	for (int i = 0; i < dir->num_entries; i++) {
+		file_entry_t file_entry = directory_entry(dir, i);
+		if (file_entry->filename[0] == 0) {
+			continue;
+		}
+		directory_index_insert(dir, i);
+		dir->num_files++;
+		if (file_entry->type == FILE_TYPE_INLINE
+			&& !directory_reserve_entries(dir, file_entry->inline_entry, inline_entries(file_entry->file_size))) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int directory_add_block(directory_t dir, uint16_t fat_idx) {
+	int num_blocks = dir->num_blocks + 1;
+	int num_words = num_blocks * DIRECTORY_BLOCK_ENTRIES / 64;
+	uint16_t *block_fat_idx = realloc(dir->block_fat_idx, num_blocks * sizeof(uint16_t));
+	if (block_fat_idx == NULL) {
+		return -1;
+	}
+	dir->block_fat_idx = block_fat_idx;
+	bool *dirty_blocks = realloc(dir->dirty_blocks, num_blocks * sizeof(bool));
+	if (dirty_blocks == NULL) {
+		return -1;
+	}
+	dir->dirty_blocks = dirty_blocks;
+	uint64_t *free_entries = realloc(dir->free_entries, num_words * sizeof(uint64_t));
+	if (free_entries == NULL) {
+		return -1;
+	}
+	dir->free_entries = free_entries;
+	uint64_t *logged_entries = realloc(dir->logged_entries, num_words * sizeof(uint64_t));
+	if (logged_entries == NULL) {
+		return -1;
+	}
+	dir->logged_entries = logged_entries;
+
+	// New blocks start empty, and are written as such unless read from disk.
+	// Their entries are unused, and logged when first changed. Lookups may be
+	// reading the blocks of indexed directories, which get a new array
+	struct file_entry **blocks = malloc(num_blocks * sizeof(struct file_entry *));
+	if (blocks == NULL) {
+		return -1;
+	}
+	blocks[num_blocks - 1] = calloc(DIRECTORY_BLOCK_ENTRIES, sizeof(struct file_entry));
+	if (blocks[num_blocks - 1] == NULL) {
+		free(blocks);
+		return -1;
+	}
+	struct file_entry **old_blocks = dir->blocks;
+	if (old_blocks != NULL) {
+		memcpy(blocks, old_blocks, dir->num_blocks * sizeof(struct file_entry *));
+	}
+	__atomic_store_n(&dir->blocks, blocks, __ATOMIC_RELEASE);
+	if (old_blocks != NULL && dir->index != NULL) {
+		epoch_retire(old_blocks, free);
+	} else {
+		free(old_blocks);
+	}
+	for (int word = dir->num_entries / 64; word < num_words; word++) {
+		dir->free_entries[word] = UINT64_MAX;
+		dir->logged_entries[word] = 0;
+	}
+	dir->block_fat_idx[num_blocks - 1] = fat_idx;
+	dir->dirty_blocks[num_blocks - 1] = true;
+	dir->num_blocks = num_blocks;
+	dir->num_entries += DIRECTORY_BLOCK_ENTRIES;
+
+	// Directories being loaded are indexed once all their entries are read
+	if (dir->index != NULL && directory_index_resize(dir) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+void directory_free(directory_t dir) {
+	for (int i = 0; i < dir->num_blocks; i++) {
+		free(dir->blocks[i]);
+	}
+	free(dir->blocks);
+	free(dir->block_fat_idx);
+	free(dir->dirty_blocks);
+	free(dir->logged_entries);
+	free(dir->index);
+	free(dir->free_entries);
+	free(dir);
+}
+
+void directory_release(void *dir) {
+	directory_free(dir);
+}
+
+int link_root_directory_blocks() {
+	// Locate the extension blocks along their chain, adding the missing ones
+	int block = 1;
+	int fat_idx = superblock->directory_signature == DIRECTORY_SIGNATURE
+		? superblock->directory_start
+		: FAT_EOC;
+	for (; fat_idx != FAT_EOC; fat_idx = fat->entries[fat_idx], block++) {
+		if (block > fat->num_entries || fat_idx >= fat->num_entries) {
+			return -1;
+		}
+		if (block == root_directory->num_blocks && directory_add_block(root_directory, fat_idx) == -1) {
+			return -1;
+		}
+		root_directory->block_fat_idx[block] = fat_idx;
+	}
+
+	// Blocks holding entries must all be part of the chain
+	return block == root_directory->num_blocks ? 0 : -1;
+}
+
+int initialize_directory() {
+	root_directory = calloc(1, sizeof(struct directory));
+	if (root_directory == NULL || directory_add_block(root_directory, FAT_EOC) == -1) {
+		return -1;
+	}
+
+	// Read the root directory block, then the extension blocks
+	if (link_root_directory_blocks() == -1) {
+		return -1;
+	}
+	for (int block = 0; block < root_directory->num_blocks; block++) {
+		if (block_read(directory_disk_block(root_directory, block), root_directory->blocks[block]) == -1) {
+			return -1;
+		}
+		root_directory->dirty_blocks[block] = false;
+	}
+	superblock_dirty = false;
+	return 0;
+}
+
+directory_t dentry_cache_find(directory_t parent, int entry_idx) {
+	// Subdirectories are published whole, and removed ones stay readable until
+	// the lookups in progress are over
+	directory_t dir = __atomic_load_n(&dentry_cache[dentry_cache_bucket(parent, entry_idx)], __ATOMIC_ACQUIRE);
+	while (dir != NULL && (dir->parent != parent || dir->parent_entry_idx != entry_idx)) {
+		dir = __atomic_load_n(&dir->dentry_next, __ATOMIC_ACQUIRE);
+	}
+	return dir;
+}
+
+void dentry_cache_remove(directory_t dir) {
+	pthread_mutex_lock(&dentry_cache_lock);
+	directory_t *link = &dentry_cache[dentry_cache_bucket(dir->parent, dir->parent_entry_idx)];
+	while (*link != dir) {
+		link = &(*link)->dentry_next;
+	}
+	__atomic_store_n(link, dir->dentry_next, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dentry_cache_lock);
+}
+
+int checkpoint_metadata() {
+	// Write everything the journal describes in place, after which it can be emptied
+	if (cache_sync() == -1
+		|| write_dirty_metadata() == -1
+		|| block_disk_sync() == -1) {
+		return -1;
+	}
+	return journal_reset();
+}
+
+// Largest length of a directory entry record
+#define ENTRY_RECORD_SIZE MAX(sizeof(struct root_record), sizeof(struct entry_record))
+
+size_t metadata_log_capacity() {
+	// Length of the largest transaction there can be, logging every FAT entry
+	// and every loaded directory entry
+	size_t capacity = fat->num_entries * sizeof(struct fat_record) + sizeof(struct directory_record);
+	pthread_mutex_lock(&dentry_cache_lock);
+	for (directory_t dir = next_loaded_directory(NULL); dir != NULL; dir = next_loaded_directory(dir)) {
+		capacity += dir->num_entries * ENTRY_RECORD_SIZE;
+	}
+	pthread_mutex_unlock(&dentry_cache_lock);
+	return capacity;
+}
+
+int metadata_log_reserve(size_t capacity) {
+	// Make room for the records of the largest transaction
+	if (capacity <= metadata_log->records_capacity) {
+		return 0;
+	}
+	uint8_t *records = realloc(metadata_log->records, capacity);
+	if (records == NULL) {
+		return -1;
+	}
+	metadata_log->records = records;
+	metadata_log->records_capacity = capacity;
+	return 0;
+}
+
+size_t log_directory_entries(directory_t dir, size_t length) {
+	for (int word = 0; word < dir->num_entries / 64; word++) {
+		while (dir->logged_entries[word] != 0) {
+			int entry_idx = word * 64 + __builtin_ctzll(dir->logged_entries[word]);
+			if (dir == root_directory) {
+				struct root_record *record = (struct root_record*) &metadata_log->records[length];
+				record->type = JOURNAL_RECORD_ROOT;
+				record->entry_idx = entry_idx;
+				record->file_entry = *directory_entry(dir, entry_idx);
+				length += sizeof(struct root_record);
+			} else {
+				struct entry_record *record = (struct entry_record*) &metadata_log->records[length];
+				record->type = JOURNAL_RECORD_ENTRY;
+				record->fat_idx = dir->block_fat_idx[entry_idx / DIRECTORY_BLOCK_ENTRIES];
+				record->slot = entry_idx % DIRECTORY_BLOCK_ENTRIES;
+				record->file_entry = *directory_entry(dir, entry_idx);
+				length += sizeof(struct entry_record);
+			}
+			dir->logged_entries[word] &= dir->logged_entries[word] - 1;
+		}
+	}
+	return length;
+}
+
+void metadata_log_wait_others() {
+	// Let operations running alongside add their changes to the transaction
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += metadata_log->commit_delay_ms / 1000;
+	deadline.tv_nsec += metadata_log->commit_delay_ms % 1000 * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	while (pthread_cond_timedwait(&metadata_log_committed, &metadata_lock, &deadline) != ETIMEDOUT) {
+	}
+}
+
+void metadata_log_commit(bool force, bool checkpoint) {
+	// Gather the open transaction, then write it to the journal without the
+	// metadata lock, so that other operations add their changes to the next
+	// one meanwhile. It is committed by whichever of them gets there first
+	metadata_log->committing = true;
+	if (!force && metadata_log->commit_delay_ms > 0) {
+		metadata_log_wait_others();
+	}
+	uint64_t sequence = metadata_log->open_sequence++;
+
+	// File data is durable before the metadata pointing to it
+	int ret = -1;
+	size_t capacity = metadata_log_capacity();
+	if (cache_sync() == 0 && block_disk_sync() == 0 && metadata_log_reserve(capacity) == 0) {
+		// Log the current value of every entry that changed since the last commit
+		size_t length = 0;
+		for (int word = 0; word < (fat->num_entries + 63) / 64; word++) {
+			while (metadata_log->dirty_fat_entries[word] != 0) {
+				int fat_idx = word * 64 + __builtin_ctzll(metadata_log->dirty_fat_entries[word]);
+				struct fat_record *record = (struct fat_record*) &metadata_log->records[length];
+				record->type = JOURNAL_RECORD_FAT;
+				record->fat_idx = fat_idx;
+				record->value = fat->entries[fat_idx];
+				length += sizeof(struct fat_record);
+				metadata_log->dirty_fat_entries[word] &= metadata_log->dirty_fat_entries[word] - 1;
+			}
+		}
+		pthread_mutex_lock(&dentry_cache_lock);
+		for (directory_t dir = next_loaded_directory(NULL); dir != NULL; dir = next_loaded_directory(dir)) {
+			length = log_directory_entries(dir, length);
+		}
+		pthread_mutex_unlock(&dentry_cache_lock);
+		if (metadata_log->directory_start_changed) {
+			struct directory_record *record = (struct directory_record*) &metadata_log->records[length];
+			record->type = JOURNAL_RECORD_DIRECTORY;
+			record->directory_start = superblock->directory_start;
+			length += sizeof(struct directory_record);
+			metadata_log->directory_start_changed = false;
+		}
+		metadata_log->pending = false;
+
+		// The journal keeps room for the next transaction, as large as the
+		// capacity at most, counting the block this one may leave partly used.
+		// When it would run low, the metadata lock is kept until this one is
+		// committed, so that the metadata then matches the journal and can be
+		// written in place to empty it
+		checkpoint = checkpoint || journal_room() < length + capacity + 2 * BLOCK_SIZE;
+		if (!checkpoint) {
+			pthread_mutex_unlock(&metadata_lock);
+		}
+		ret = journal_commit(metadata_log->records, length);
+		if (!checkpoint) {
+			pthread_mutex_lock(&metadata_lock);
+		} else if (ret == 0) {
+			ret = checkpoint_metadata();
+		}
+
+		// Only a transaction larger than the whole journal does not fit
+		if (ret == 1) {
+			ret = -1;
+		}
+	}
+
+	if (ret == -1) {
+		metadata_log->failed_sequence = sequence;
+	}
+	metadata_log->durable_sequence = sequence;
+	metadata_log->committing = false;
+	pthread_cond_broadcast(&metadata_log_committed);
+}
+
+int metadata_log_make_room(size_t length) {
+	// Directories growing or being loaded make the largest transaction larger.
+	// When the journal would not have room for it, the changes made so far are
+	// committed and the journal emptied beforehand, while nothing else changes
+	if (metadata_log == NULL) {
+		return 0;
+	}
+	while (metadata_log->committing) {
+		pthread_cond_wait(&metadata_log_committed, &metadata_lock);
+	}
+	if (journal_room() >= metadata_log_capacity() + length) {
+		return 0;
+	}
+	if (!metadata_log->pending) {
+		return checkpoint_metadata();
+	}
+	uint64_t sequence = metadata_log->open_sequence;
+	metadata_log_commit(true, true);
+	return metadata_log->failed_sequence >= sequence ? -1 : 0;
+}
+
+int commit_metadata_log(bool force) {
+	// The changes made so far are in the open transaction, or in the one being
+	// committed if they were gathered already. Return once it is durable,
+	// committing it unless another thread is on it
+	if (metadata_log == NULL) {
+		return 0;
+	}
+	uint64_t sequence = metadata_log->pending ? metadata_log->open_sequence : metadata_log->open_sequence - 1;
+	while (metadata_log->durable_sequence < sequence) {
+		if (metadata_log->committing) {
+			pthread_cond_wait(&metadata_log_committed, &metadata_lock);
+		} else {
+			metadata_log_commit(force, false);
+		}
+	}
+	return sequence > 0 && metadata_log->failed_sequence >= sequence ? -1 : 0;
+}
+
+directory_t directory_load(directory_t parent, int entry_idx) {
+	directory_t dir = calloc(1, sizeof(struct directory));
+	if (dir == NULL) {
+		return NULL;
+	}
+	dir->parent = parent;
+	dir->parent_entry_idx = entry_idx;
+
+	// Read the blocks of the subdirectory along its chain
+	int fat_idx = directory_entry(parent, entry_idx)->index_first_data_block;
+	for (; fat_idx != FAT_EOC; fat_idx = fat->entries[fat_idx]) {
+		if (dir->num_blocks >= fat->num_entries
+			|| fat_idx >= fat->num_entries
+			|| directory_add_block(dir, fat_idx) == -1
+			|| block_read(directory_disk_block(dir, dir->num_blocks - 1), dir->blocks[dir->num_blocks - 1]) == -1) {
+			directory_free(dir);
+			return NULL;
+		}
+		dir->dirty_blocks[dir->num_blocks - 1] = false;
+	}
+	if (directory_index_build(dir) == -1) {
+		directory_free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+directory_t directory_open(directory_t parent, int entry_idx) {
+	// Subdirectories already walked through are resolved without the disk
+	pthread_mutex_lock(&dentry_cache_lock);
+	directory_t dir = dentry_cache_find(parent, entry_idx);
+	pthread_mutex_unlock(&dentry_cache_lock);
+	if (dir != NULL) {
+		return dir;
+	}
+
+	// The others are loaded by a single thread, the first one to get the
+	// metadata lock, once the journal has room for logging their entries
+	pthread_mutex_lock(&metadata_lock);
+	pthread_mutex_lock(&dentry_cache_lock);
+	dir = dentry_cache_find(parent, entry_idx);
+	pthread_mutex_unlock(&dentry_cache_lock);
+	if (dir == NULL) {
+		dir = directory_load(parent, entry_idx);
+		if (dir != NULL && metadata_log_make_room(dir->num_entries * ENTRY_RECORD_SIZE) == -1) {
+			directory_free(dir);
+			dir = NULL;
+		}
+		if (dir != NULL) {
+			pthread_mutex_lock(&dentry_cache_lock);
+			size_t bucket = dentry_cache_bucket(parent, entry_idx);
+			dir->dentry_next = dentry_cache[bucket];
+			__atomic_store_n(&dentry_cache[bucket], dir, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&dentry_cache_lock);
+		}
+	}
+	pthread_mutex_unlock(&metadata_lock);
+	return dir;
+}
+
+int directory_grow(directory_t dir) {
+	// The whole new block is logged
+	if (metadata_log_make_room(DIRECTORY_BLOCK_ENTRIES * ENTRY_RECORD_SIZE) == -1) {
+		return -1;
+	}
+
+	// Chain a new block after the last one, or start the chain
+	bool is_root = dir == root_directory;
+	int first_block = is_root ? 1 : 0;
+	int last_block = dir->num_blocks - 1;
+	int goal = last_block >= first_block
+		? dir->block_fat_idx[last_block] + 1
+		: __atomic_load_n(&free_space->rotor, __ATOMIC_RELAXED);
+	int extent_length;
+	int fat_idx = free_space_allocate_extent(goal, 1, &extent_length);
+	if (fat_idx == -1) {
+		return -1;
+	}
+	if (directory_add_block(dir, fat_idx) == -1) {
+		free_space_release(fat_idx);
+		return -1;
+	}
+
+	// The whole block is logged, as whatever it held on disk before is stale
+	cache_invalidate_range(fat_idx + superblock->data_block_start_index, 1);
+	if (metadata_log != NULL) {
+		metadata_log_start();
+		for (int word = (dir->num_entries - DIRECTORY_BLOCK_ENTRIES) / 64; word < dir->num_entries / 64; word++) {
+			dir->logged_entries[word] = UINT64_MAX;
+		}
+	}
+
+	fat_set_entry(fat_idx, FAT_EOC);
+	fat->fat_free--;
+	if (last_block >= first_block) {
+		fat_set_entry(dir->block_fat_idx[last_block], fat_idx);
+	} else if (is_root) {
+		directory_set_start(fat_idx);
+	} else {
+		directory_entry(dir->parent, dir->parent_entry_idx)->index_first_data_block = fat_idx;
+	}
+
+	// Subdirectories are sized like files, in whole blocks
+	if (!is_root) {
+		directory_entry(dir->parent, dir->parent_entry_idx)->file_size += BLOCK_SIZE;
+		directory_mark_dirty(dir->parent, dir->parent_entry_idx);
+	}
+	return 0;
+}
+
+// Subdirectory blocks patched by the journal replay, written once it is over
+struct replay_block {
+	uint16_t fat_idx;
+	struct file_entry *entries;
+};
+
+struct replay_block *replay_blocks;
+size_t num_replay_blocks;
+
+struct file_entry *replay_block_entries(uint16_t fat_idx) {
+	for (size_t i = 0; i < num_replay_blocks; i++) {
+		if (replay_blocks[i].fat_idx == fat_idx) {
+			return replay_blocks[i].entries;
+		}
+	}
+
+	// Patch the block as it is on disk
+	struct replay_block *blocks = realloc(replay_blocks, (num_replay_blocks + 1) * sizeof(struct replay_block));
+	if (blocks == NULL) {
+		return NULL;
+	}
+	replay_blocks = blocks;
+	struct file_entry *entries = malloc(BLOCK_SIZE);
+	if (entries == NULL || block_read(fat_idx + superblock->data_block_start_index, entries) == -1) {
+		free(entries);
+		return NULL;
+	}
+	replay_blocks[num_replay_blocks].fat_idx = fat_idx;
+	replay_blocks[num_replay_blocks].entries = entries;
+	num_replay_blocks++;
+	return entries;
+}
+
+void replay_block_discard(uint16_t fat_idx) {
+	// Freed blocks may since hold file data, which must not be overwritten
+	for (size_t i = 0; i < num_replay_blocks; i++) {
+		if (replay_blocks[i].fat_idx == fat_idx) {
+			free(replay_blocks[i].entries);
+			replay_blocks[i] = replay_blocks[--num_replay_blocks];
+			return;
+		}
+	}
+}
+
+int write_replay_blocks() {
+	int ret = 0;
+	for (size_t i = 0; i < num_replay_blocks; i++) {
+		if (ret == 0 && block_write(replay_blocks[i].fat_idx + superblock->data_block_start_index,
+			replay_blocks[i].entries) == -1) {
+			ret = -1;
+		}
+		free(replay_blocks[i].entries);
+	}
+	free(replay_blocks);
+	replay_blocks = NULL;
+	num_replay_blocks = 0;
+	return ret;
+}
+
+int apply_journal_records(const void *records, size_t length) {
+	const uint8_t *record = records;
+	const uint8_t *end = record + length;
+	while (record < end) {
+		if (*record == JOURNAL_RECORD_FAT && end - record >= (long)sizeof(struct fat_record)) {
+			const struct fat_record *fat_record = (const struct fat_record*) record;
+			if (fat_record->fat_idx >= fat->num_entries) {
+				return -1;
+			}
+			fat_set_entry(fat_record->fat_idx, fat_record->value);
+			if (fat_record->value == 0) {
+				replay_block_discard(fat_record->fat_idx);
+			}
+			record += sizeof(struct fat_record);
+		} else if (*record == JOURNAL_RECORD_ROOT && end - record >= (long)sizeof(struct root_record)) {
+			// Entries of extension blocks created since the last checkpoint
+			// come with the blocks, which are linked once the replay is over
+			const struct root_record *root_record = (const struct root_record*) record;
+			while (root_record->entry_idx >= (uint32_t)root_directory->num_entries) {
+				if (root_record->entry_idx >= (uint32_t)fat->num_entries * DIRECTORY_BLOCK_ENTRIES
+					|| directory_add_block(root_directory, FAT_EOC) == -1) {
+					return -1;
+				}
+			}
+			*directory_entry(root_directory, root_record->entry_idx) = root_record->file_entry;
+			directory_mark_dirty(root_directory, root_record->entry_idx);
+			record += sizeof(struct root_record);
+		} else if (*record == JOURNAL_RECORD_DIRECTORY && end - record >= (long)sizeof(struct directory_record)) {
+			const struct directory_record *directory_record = (const struct directory_record*) record;
+			if (directory_record->directory_start == 0
+				|| directory_record->directory_start >= fat->num_entries) {
+				return -1;
+			}
+			directory_set_start(directory_record->directory_start);
+			record += sizeof(struct directory_record);
+		} else if (*record == JOURNAL_RECORD_ENTRY && end - record >= (long)sizeof(struct entry_record)) {
+			const struct entry_record *entry_record = (const struct entry_record*) record;
+			if (entry_record->fat_idx == 0
+				|| entry_record->fat_idx >= fat->num_entries
+				|| entry_record->slot >= DIRECTORY_BLOCK_ENTRIES) {
+				return -1;
+			}
+			struct file_entry *entries = replay_block_entries(entry_record->fat_idx);
+			if (entries == NULL) {
+				return -1;
+			}
+			entries[entry_record->slot] = entry_record->file_entry;
+			record += sizeof(struct entry_record);
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int create_journal(int length) {
+	// Reserve the last run of free data blocks long enough for the journal
+	int start = -1;
+	int run_length = 0;
+	for (int fat_idx = fat->num_entries - 1; fat_idx > 0 && start == -1; fat_idx--) {
+		run_length = fat->entries[fat_idx] == 0 ? run_length + 1 : 0;
+		if (run_length == length) {
+			start = fat_idx;
+		}
+	}
+	if (start == -1) {
+		return -1;
+	}
+
+	// Chain the blocks in the FAT so that they are seen as used, without a file owning them
+	for (int fat_idx = start; fat_idx < start + length; fat_idx++) {
+		fat_set_entry(fat_idx, fat_idx + 1 < start + length ? fat_idx + 1 : FAT_EOC);
+		fat->fat_free--;
+	}
+	if (journal_format(start + superblock->data_block_start_index, length) == -1
+		|| write_dirty_metadata() == -1
+		|| block_disk_sync() == -1) {
+		return -1;
+	}
+
+	// Only then point the superblock to the journal
+	superblock->journal_signature = JOURNAL_SIGNATURE;
+	superblock->journal_start = start;
+	superblock->journal_length = length;
+	if (block_write(0, superblock) == -1) {
+		return -1;
+	}
+	return block_disk_sync();
+}
+
+int initialize_journal() {
+	// Disks get a journal when asked to, and keep it afterwards
+	bool has_journal = superblock->journal_signature == JOURNAL_SIGNATURE;
+	const char *journal_blocks = getenv(JOURNAL_BLOCKS_ENV);
+	if (!has_journal) {
+		if (journal_blocks == NULL || atoi(journal_blocks) < 2) {
+			return 0;
+		}
+		if (create_journal(atoi(journal_blocks)) == -1) {
+			return -1;
+		}
+	} else if (journal_open(superblock->journal_start + superblock->data_block_start_index,
+		superblock->journal_length) == -1) {
+		return -1;
+	}
+
+	// Bring the metadata up to date with the transactions committed before the
+	// disk was last unmounted, and write it in place
+	int replayed = journal_replay(apply_journal_records);
+	if (write_replay_blocks() == -1
+		|| replayed == -1
+		|| (replayed > 0 && (link_root_directory_blocks() == -1 || checkpoint_metadata() == -1))) {
+		return -1;
+	}
+
+	metadata_log = calloc(1, sizeof(struct metadata_log));
+	if (metadata_log == NULL) {
+		return -1;
+	}
+	metadata_log->dirty_fat_entries = calloc((fat->num_entries + 63) / 64, sizeof(uint64_t));
+	if (metadata_log->dirty_fat_entries == NULL) {
+		return -1;
+	}
+
+	metadata_log->open_sequence = 1;
+	const char *commit_delay = getenv(JOURNAL_COMMIT_MS_ENV);
+	metadata_log->commit_delay_ms = commit_delay != NULL ? MAX(atol(commit_delay), 0) : 0;
+	return 0;
+}
+
+bool validate_fat() {
+	// Validate that first fat entry is FAT_EOC
+	if (fat->entries[0] != FAT_EOC) {
+		printf("the first fat entry should be 0xFFFF, instead its %x\n", fat->entries[0]);
+		return false;
+	}
+
+	return true;
+}
+
+file_descriptor_entry_t file_descriptor(int fd) {
+	// Chunk c starts at descriptor FILE_TABLE_MIN_ENTRIES * (2^c - 1)
+	int chunk = 31 - __builtin_clz(fd / FILE_TABLE_MIN_ENTRIES + 1);
+	return &file_descriptor_chunks[chunk][fd - FILE_TABLE_MIN_ENTRIES * ((1 << chunk) - 1)];
+}
+
+int file_descriptor_table_grow() {
+	// Add a chunk twice as large as the last one, up to the limit. Chunks are
+	// never moved, so that descriptors stay put while other threads use them
+	int chunk = file_descriptor_num_chunks;
+	if (chunk == FILE_TABLE_MAX_CHUNKS) {
+		return -1;
+	}
+	int size = MIN(file_descriptor_table_size + (FILE_TABLE_MIN_ENTRIES << chunk), file_descriptor_limit);
+	if (size <= file_descriptor_table_size) {
+		return -1;
+	}
+	file_descriptor_chunks[chunk] = malloc((size - file_descriptor_table_size) * sizeof(struct file_descriptor_entry));
+	if (file_descriptor_chunks[chunk] == NULL) {
+		return -1;
+	}
+	file_descriptor_num_chunks++;
+
+	// Chain the new descriptors in order, so that the lowest ones are used first
+	for (int fd = file_descriptor_table_size; fd < size; fd++) {
+		file_descriptor_entry_t file_descriptor_entry = file_descriptor(fd);
+		pthread_mutex_init(&file_descriptor_entry->lock, NULL);
+		file_descriptor_entry->inode = NULL;
+		file_descriptor_entry->offset = 0;
+		file_descriptor_entry->fd = fd;
+		file_descriptor_entry->is_open = false;
+		file_descriptor_entry->next_free = fd + 1 < size ? fd + 1 : free_file_descriptor;
+		file_descriptor_entry->readahead_next = 0;
+		file_descriptor_entry->readahead_window = 0;
+		file_descriptor_entry->readahead_until = 0;
+		file_descriptor_entry->allocation_goal = 0;
+		file_descriptor_entry->positional_calls = 0;
+		file_descriptor_entry->transfer_buffers = NULL;
+		file_descriptor_entry->transfer_requests = NULL;
+		file_descriptor_entry->transfer_capacity = 0;
+		file_descriptor_entry->buffered = false;
+	}
+	free_file_descriptor = file_descriptor_table_size;
+
+	// Descriptors are looked up without the table lock once they are set up
+	__atomic_store_n(&file_descriptor_table_size, size, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int file_descriptor_alloc() {
+	pthread_mutex_lock(&file_descriptor_table_lock);
+	int fd = -1;
+	if (free_file_descriptor != -1 || file_descriptor_table_grow() == 0) {
+		fd = free_file_descriptor;
+		free_file_descriptor = file_descriptor(fd)->next_free;
+		num_files_open++;
+	}
+	pthread_mutex_unlock(&file_descriptor_table_lock);
+	return fd;
+}
+
+void file_descriptor_release(int fd) {
+	pthread_mutex_lock(&file_descriptor_table_lock);
+	file_descriptor(fd)->next_free = free_file_descriptor;
+	free_file_descriptor = fd;
+	num_files_open--;
+	pthread_mutex_unlock(&file_descriptor_table_lock);
+}
+
+int initialize_file_descriptor_table() {
+	// The number of open files can be raised from the environment
+	const char *open_max = getenv(FS_OPEN_MAX_ENV);
+	file_descriptor_limit = open_max != NULL && atoi(open_max) > 0 ? atoi(open_max) : FS_OPEN_MAX_COUNT;
+	file_descriptor_num_chunks = 0;
+	file_descriptor_table_size = 0;
+	free_file_descriptor = -1;
+	return file_descriptor_table_grow();
+}
+
+void free_file_descriptor_table() {
+	for (int fd = 0; fd < file_descriptor_table_size; fd++) {
+		pthread_mutex_destroy(&file_descriptor(fd)->lock);
+	}
+	for (int chunk = 0; chunk < file_descriptor_num_chunks; chunk++) {
+		free(file_descriptor_chunks[chunk]);
+	}
+	file_descriptor_num_chunks = 0;
+	file_descriptor_table_size = 0;
+}
+
+int initialize_inline_data() {
+	// Disks store small files inline when asked to, and keep doing so
+	// afterwards. Their signature keeps other implementations from mounting them
+	uint8_t inline_signature_array[] = {'E','C','S','1','5','0','F','I'};
+	const char *inline_data = getenv(FS_INLINE_DATA_ENV);
+	bool signed_inline = memcmp(&(superblock->signature), inline_signature_array, SIGNATURE_LENGTH) == 0;
+	if (superblock->inline_signature == INLINE_SIGNATURE
+		? signed_inline
+		: inline_data == NULL || atoi(inline_data) <= 0) {
+		return 0;
+	}
+	memcpy(&(superblock->signature), inline_signature_array, SIGNATURE_LENGTH);
+	superblock->inline_signature = INLINE_SIGNATURE;
+	if (block_write(0, superblock) == -1) {
+		return -1;
+	}
+	return block_disk_sync();
+}
+
+size_t cache_num_blocks() {
+	// Cache size can be tuned from the environment
+	const char *cache_blocks = getenv(CACHE_BLOCKS_ENV);
+	if (cache_blocks != NULL && atoi(cache_blocks) > 0) {
+		return atoi(cache_blocks);
+	}
+	return CACHE_DEFAULT_BLOCKS;
+}
+
+int mount_disk(const char *diskname) {
+	// Handle case where disk is already open
+	if (disk_open) {
+		return -1;
+	}
+
+	// Handle case where opening disk fails
+	if (block_disk_open(diskname) == -1) {
+		return -1;
+	}
+
+	// Allocate memory for the superblock, fat, and root directory
+	superblock = malloc(sizeof(struct superblock));
+	fat = malloc(sizeof(struct fat));
+	free_space = malloc(sizeof(struct free_space));
+	if (superblock == NULL
+		|| fat == NULL
+		|| free_space == NULL) {
+		return -1;
+	}
+
+	// Set number of open files to 0
+	num_files_open = 0;
+
+	// Read superblock from disk
+	block_read(0, superblock);
+
+	// Validate data members for superblock
+	if (!validate_superblock()) {
+		return -1;
+	}
+
+	// Initialize data members for fat
+	if (initialize_fat() == -1) {
+		return -1;
+	}
+
+	// Validate data members for fat
+	if (!validate_fat()) {
+		return -1;
+	}
+
+	// Turn on inline storage of small files if requested
+	if (initialize_inline_data() == -1) {
+		return -1;
+	}
+
+	// Read root directory from disk, with its extension blocks
+	memset(dentry_cache, 0, sizeof(dentry_cache));
+	memset(inode_table, 0, sizeof(inode_table));
+	if (initialize_directory() == -1) {
+		return -1;
+	}
+
+	// Replay the metadata journal, setting it up first if requested
+	metadata_log = NULL;
+	if (initialize_journal() == -1) {
+		return -1;
+	}
+
+	// Index the free data blocks
+	if (initialize_free_space() == -1) {
+		return -1;
+	}
+
+	// Index the files of the root directory by name
+	if (directory_index_build(root_directory) == -1) {
+		return -1;
+	}
+
+	// Initialize file_descriptors_table
+	if (initialize_file_descriptor_table() == -1) {
+		return -1;
+	}
+
+	// Set up the buffer cache for data blocks
+	if (cache_init(cache_num_blocks()) == -1) {
+		return -1;
+	}
+
+	// Mark disk as open, letting calls on it start
+	__atomic_store_n(&disk_open, true, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+int fs_mount(const char *diskname)
+{
+	// Calls on the disk only start once it is mounted
+	pthread_mutex_lock(&mount_lock);
+	int ret = mount_disk(diskname);
+	pthread_mutex_unlock(&mount_lock);
+	return ret;
+}
+
+int unmount_disk() {
+	// Ensure no file is open
+	if (num_files_open) {
+		return -1;
+	}
+
+	// Write the FAT blocks and root directory that changed to disk, and empty
+	// the journal as it then holds nothing that is not in place
+	if (metadata_log != NULL) {
+		if (checkpoint_metadata() == -1) {
+			return -1;
+		}
+		journal_close();
+		free(metadata_log->dirty_fat_entries);
+		free(metadata_log->records);
+		free(metadata_log);
+		metadata_log = NULL;
+	} else if (write_dirty_metadata() == -1) {
+		return -1;
+	}
+
+	// Write back cached data blocks
+	if (cache_destroy() == -1) {
+		return -1;
+	}
+
+	// Close disk
+	if (block_disk_close() == -1) {
+		return -1;
+	}
+
+	// Free local disk data members
+	free(superblock);
+	free(fat->entries);
+	free(fat->dirty_blocks);
+	free(fat);
+	free(free_space->used_bitmap);
+	free(free_space->full_bitmap);
+	free(free_space);
+	for (int bucket = 0; bucket < DENTRY_CACHE_BUCKETS; bucket++) {
+		while (dentry_cache[bucket] != NULL) {
+			directory_t dir = dentry_cache[bucket];
+			dentry_cache[bucket] = dir->dentry_next;
+			directory_free(dir);
+		}
+	}
+	directory_free(root_directory);
+	free_file_descriptor_table();
+	return 0;
+}
+
+int fs_umount(void)
+{
+	// Ensure disk is open, without files open
+	pthread_mutex_lock(&mount_lock);
+	pthread_mutex_lock(&file_descriptor_table_lock);
+	bool busy = !disk_open || num_files_open;
+	pthread_mutex_unlock(&file_descriptor_table_lock);
+	if (busy) {
+		pthread_mutex_unlock(&mount_lock);
+		return -1;
+	}
+
+	// Mark disk as closed, then wait for the calls in progress on the disk to
+	// return. It is marked open again if it cannot be unmounted
+	__atomic_store_n(&disk_open, false, __ATOMIC_SEQ_CST);
+	epoch_synchronize();
+	int ret = unmount_disk();
+	if (ret == -1) {
+		__atomic_store_n(&disk_open, true, __ATOMIC_SEQ_CST);
+	} else {
+		epoch_reclaim();
+	}
+	pthread_mutex_unlock(&mount_lock);
+	return ret;
+}
+
+bool mount_enter() {
+	// Every call runs inside an epoch, so that the disk stays mounted until it returns
+	if (!epoch_enter()) {
+		return false;
+	}
+	if (!__atomic_load_n(&disk_open, __ATOMIC_SEQ_CST)) {
+		epoch_exit();
+		return false;
+	}
+	return true;
+}
+
+void mount_exit() {
+	epoch_exit();
+}
+
+int sync_disk() {
+	// Write back file data before the metadata pointing to it
+	pthread_rwlock_rdlock(&namespace_lock);
+	pthread_mutex_lock(&metadata_lock);
+	int ret = cache_sync();
+
+	// Commit the metadata changes to the journal, or write them in place without one
+	if (ret == 0) {
+		ret = metadata_log != NULL ? commit_metadata_log(true) : write_dirty_metadata();
+	}
+	pthread_mutex_unlock(&metadata_lock);
+	pthread_rwlock_unlock(&namespace_lock);
+
+	// Make everything written so far durable
+	return ret == 0 ? block_disk_sync() : -1;
+}
+
+int fs_info(void)
+{
+	if (!mount_enter()) {
+		return -1;
+	}
+	pthread_rwlock_rdlock(&namespace_lock);
+	pthread_mutex_lock(&metadata_lock);
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%d\n", block_disk_count());
+	printf("fat_blk_count=%d\n", superblock->num_fat_blocks);
+	printf("rdir_blk=%d\n", superblock->num_fat_blocks+1);
+	printf("data_blk=%d\n", superblock->num_fat_blocks+2);
+	printf("data_blk_count=%d\n", superblock->num_data_blocks);
+	printf("fat_free_ratio=%d/%d\n", fat->fat_free, superblock->num_data_blocks);
+	int rdir_free = 0;
+	for (int word = 0; word < root_directory->num_entries / 64; word++) {
+		rdir_free += __builtin_popcountll(root_directory->free_entries[word]);
+	}
+	printf("rdir_free_ratio=%d/%d\n", rdir_free, root_directory->num_entries);
+
+	pthread_mutex_unlock(&metadata_lock);
+	pthread_rwlock_unlock(&namespace_lock);
+	mount_exit();
+	return 0;
+}
+
+size_t inode_table_bucket(directory_t dir, int entry_idx) {
+	return ((uintptr_t)dir / sizeof(struct directory) * 31 + entry_idx) % INODE_TABLE_BUCKETS;
+}
+
+inode_t inode_find(directory_t dir, int entry_idx) {
+	inode_t inode = inode_table[inode_table_bucket(dir, entry_idx)];
+	while (inode != NULL && (inode->directory != dir || inode->entry_idx != entry_idx)) {
+		inode = inode->next;
+	}
+	return inode;
+}
+
+inode_t inode_get(directory_t dir, int entry_idx) {
+	// Files already open only gain a reference
+	inode_t inode = inode_find(dir, entry_idx);
+	if (inode != NULL) {
+		inode->refcount++;
+		return inode;
+	}
+
+	inode = malloc(sizeof(struct inode));
+	if (inode == NULL) {
+		return NULL;
+	}
+	inode->file_entry = directory_entry(dir, entry_idx);
+	inode->directory = dir;
+	inode->entry_idx = entry_idx;
+	inode->refcount = 1;
+	pthread_rwlock_init(&inode->lock, NULL);
+	inode->num_blocks = -1;
+	inode->tail_fat_idx = FAT_EOC;
+	inode->reserved_length = 0;
+	inode->reserving = false;
+	pthread_mutex_init(&inode->block_map_lock, NULL);
+	inode->block_map = NULL;
+	inode->block_map_length = 0;
+	inode->block_map_capacity = 0;
+	inode->write_buffer = NULL;
+	inode->write_buffer_length = 0;
+	inode->write_buffer_failed = false;
+
+	size_t bucket = inode_table_bucket(dir, entry_idx);
+	inode->next = inode_table[bucket];
+	inode_table[bucket] = inode;
+	return inode;
+}
+
+void inode_release(inode_t inode) {
+	inode_t *link = &inode_table[inode_table_bucket(inode->directory, inode->entry_idx)];
+	while (*link != inode) {
+		link = &(*link)->next;
+	}
+	*link = inode->next;
+	if (inode->write_buffer_length > 0) {
+		__atomic_sub_fetch(&num_write_buffers_pending, 1, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_destroy(&inode->lock);
+	pthread_mutex_destroy(&inode->block_map_lock);
+	free(inode->block_map);
+	free(inode->write_buffer);
+	free(inode);
+}
+
+void inode_count_blocks(inode_t inode) {
+	// Walk the chain once, appends then keep the count up to date
+	inode->num_blocks = 0;
+	inode->tail_fat_idx = FAT_EOC;
+	for (int fat_idx = inode->file_entry->index_first_data_block; fat_idx != FAT_EOC; fat_idx = fat->entries[fat_idx]) {
+		inode->tail_fat_idx = fat_idx;
+		inode->num_blocks++;
+	}
+}
+
+bool validate_filename(const char *filename) {
+	// Filename can't be null
+	if (filename == NULL) {
+		return false;
+	}
+
+	// Filename can't be empty
+	if (filename[0] == '\0') {
+		return false;
+	}
+
+	// Filename must contain null terminator in first 16 bytes, without reading
+	// past the terminator of shorter filenames
+	return strnlen(filename, FS_FILENAME_LEN) < FS_FILENAME_LEN;
+}
+
+directory_t resolve_root_filename(const char *path, char *filename) {
+	// Disks written before directories existed may have files of the root
+	// directory with '/' in their name, which paths whose first name is not a
+	// directory name as a whole
+	if (!validate_filename(path)) {
+		return NULL;
+	}
+	strcpy(filename, path);
+	return root_directory;
+}
+
+directory_t resolve_parent(const char *path, char *filename, bool load) {
+	// Paths are filenames separated by '/', optionally starting with one
+	if (path == NULL || strnlen(path, FS_PATH_MAX) == FS_PATH_MAX) {
+		return NULL;
+	}
+	const char *whole_path = path;
+	if (path[0] == '/') {
+		path++;
+	}
+
+	// Walk down the directories leading to the last filename
+	directory_t dir = root_directory;
+	const char *separator;
+	while ((separator = strchr(path, '/')) != NULL) {
+		size_t length = separator - path;
+		if (length == 0 || length >= FS_FILENAME_LEN) {
+			return dir == root_directory ? resolve_root_filename(whole_path, filename) : NULL;
+		}
+		memcpy(filename, path, length);
+		filename[length] = '\0';
+
+		// Without loading, only the subdirectories of the dentry cache are walked
+		bool is_directory;
+		int entry_idx = directory_lookup(dir, filename, &is_directory);
+		if (entry_idx == -1 || !is_directory) {
+			return dir == root_directory ? resolve_root_filename(whole_path, filename) : NULL;
+		}
+		dir = load ? directory_open(dir, entry_idx) : dentry_cache_find(dir, entry_idx);
+		if (dir == NULL) {
+			return NULL;
+		}
+		path = separator + 1;
+	}
+
+	if (!validate_filename(path)) {
+		return NULL;
+	}
+	strcpy(filename, path);
+	return dir;
+}
+
+directory_t resolve_directory(const char *path) {
+	// The root directory is named by an empty path, or by "/"
+	if (path != NULL && (path[0] == '\0' || strcmp(path, "/") == 0)) {
+		return root_directory;
+	}
+
+	char filename[FS_FILENAME_LEN];
+	directory_t dir = resolve_parent(path, filename, true);
+	if (dir == NULL) {
+		return NULL;
+	}
+	bool is_directory;
+	int entry_idx = directory_lookup(dir, filename, &is_directory);
+	if (entry_idx == -1 || !is_directory) {
+		return NULL;
+	}
+	return directory_open(dir, entry_idx);
+}
+
+bool file_exists_in_directory(directory_t dir, const char *filename) {
+	return directory_lookup(dir, filename, NULL) != -1;
+}
+
+bool validate_file_creation(directory_t dir, const char *filename)
+{
+	// Parent directory must exist
+	if (dir == NULL) {
+		return false;
+	}
+
+	// File should not already exists
+	if (file_exists_in_directory(dir, filename)) {
+		return false;
+	}
+
+    return true;
+}
+
+bool validate_file_deletion(directory_t dir, const char *filename) {
+	// Parent directory must exist
+	if (dir == NULL) {
+		return false;
+	}
+
+	// File must exists in directory
+	if (!file_exists_in_directory(dir, filename)) {
+		return false;
+	}
+
+	return true;
+}
+
+bool validate_file_opening(directory_t dir, const char *filename) {
+	// Parent directory must exist
+	if (dir == NULL) {
+		return false;
+	}
+
+	// File must exist in directory, and not be a directory itself
+	bool is_directory;
+	return directory_lookup(dir, filename, &is_directory) != -1 && !is_directory;
+}
+
+int directory_create_entry(directory_t dir, const char *filename, uint8_t type) {
+	// Create empty file entry in the directory, growing it when full
+	int i = directory_free_entry(dir);
+	if (i == -1) {
+		if (directory_grow(dir) == -1) {
+			return -1;
+		}
+		i = directory_free_entry(dir);
+	}
+	if (directory_index_resize(dir) == -1) {
+		return -1;
+	}
+
+	file_entry_t file_entry = directory_entry(dir, i);
+	strcpy((char *) file_entry->filename, filename);
+	file_entry->file_size = 0;
+	file_entry->index_first_data_block = FAT_EOC;
+	file_entry->type = type;
+	file_entry->inline_entry = 0;
+	directory_mark_dirty(dir, i);
+	directory_index_insert(dir, i);
+	dir->num_files++;
+	return commit_metadata_log(false);
+}
+
+int create_path(const char *path, uint8_t type) {
+	// Check if path is valid for creation
+	char name[FS_FILENAME_LEN];
+	directory_t dir = resolve_parent(path, name, true);
+	if (!validate_file_creation(dir, name)
+		|| (type == FILE_TYPE_DIRECTORY && strchr(name, '/') != NULL)) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&metadata_lock);
+	int ret = directory_create_entry(dir, name, type);
+	pthread_mutex_unlock(&metadata_lock);
+	return ret;
+}
+
+int fs_create(const char *filename)
+{
+	// Check if disk is open
+	if (!mount_enter()) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	int ret = create_path(filename, FILE_TYPE_REGULAR);
+	pthread_rwlock_unlock(&namespace_lock);
+	mount_exit();
+	return ret;
+}
+
+int fs_mkdir(const char *path)
+{
+	// Check if disk is open
+	if (!mount_enter()) {
+		return -1;
+	}
+
+	// The directory gets its first block along with its first file
+	pthread_rwlock_wrlock(&namespace_lock);
+	int ret = create_path(path, FILE_TYPE_DIRECTORY);
+	pthread_rwlock_unlock(&namespace_lock);
+	mount_exit();
+	return ret;
+}
+
+int delete_path(const char *filename) {
 	// Check if filename is valid for deletion
-	if (!validate_file_deletion(filename)) {
+	char name[FS_FILENAME_LEN];
+	directory_t dir = resolve_parent(filename, name, true);
+	if (!validate_file_deletion(dir, name)) {
+		return -1;
+	}
+
+	// Find file from its directory
+	int entry_idx = directory_lookup(dir, name, NULL);
+
+	// Return error if no file was found in directory
+	if (entry_idx == -1) {
+		return -1;
+	}
+	file_entry_t file_entry = directory_entry(dir, entry_idx);
+
+	// Directories can only be deleted once empty
+	directory_t subdir = NULL;
+	if (file_entry->type == FILE_TYPE_DIRECTORY) {
+		subdir = directory_open(dir, entry_idx);
+		if (subdir == NULL || subdir->num_files > 0) {
+			return -1;
+		}
+	}
+
+	// Make sure file is not currently open, and remove it from the index
+	// before opening it can start. Opens that found it before check the
+	// generation once they hold the lock of its inode bucket
+	pthread_mutex_t *inode_bucket_lock = &inode_table_locks[inode_table_bucket(dir, entry_idx)];
+	pthread_mutex_lock(inode_bucket_lock);
+	if (inode_find(dir, entry_idx) != NULL) {
+		pthread_mutex_unlock(inode_bucket_lock);
+		return -1;
+	}
+	directory_index_remove(dir, entry_idx);
+	__atomic_add_fetch(&namespace_generation, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(inode_bucket_lock);
+
+	// Deleted directories leave the dentry cache, and are freed once the
+	// lookups walking through them are over
+	if (subdir != NULL) {
+		dentry_cache_remove(subdir);
+		epoch_retire(subdir, directory_release);
+	}
+
+	// Give back the entries holding the data of inline files
+	pthread_mutex_lock(&metadata_lock);
+	if (file_entry->type == FILE_TYPE_INLINE) {
+		directory_release_entries(dir, file_entry->inline_entry, inline_entries(file_entry->file_size));
+	}
+
+	// Clear FAT chain
+	int fat_idx = file_entry->index_first_data_block;
+	while (fat_idx != FAT_EOC) {
+		uint16_t next_fat_idx = fat->entries[fat_idx];
+		cache_invalidate_range(fat_idx + superblock->data_block_start_index, 1);
+		free_space_release(fat_idx);
+		fat_set_entry(fat_idx, 0);
+		fat_idx = next_fat_idx;
+		fat->fat_free++;
+	}
+
+	// Clear Directory Entry
+	file_entry->filename[0] = 0;
+	file_entry->file_size = 0;
+	file_entry->index_first_data_block = 0;
+	file_entry->type = FILE_TYPE_REGULAR;
+	file_entry->inline_entry = 0;
+	directory_mark_dirty(dir, entry_idx);
+	dir->num_files--;
+	int ret = commit_metadata_log(false);
+	pthread_mutex_unlock(&metadata_lock);
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	// Check if disk is open
+	if (!mount_enter()) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	int ret = delete_path(filename);
+	pthread_rwlock_unlock(&namespace_lock);
+	mount_exit();
+	return ret;
+}
+
+int fs_ls(void)
+{
+	// Check if disk is open
+	if (!mount_enter()) {
+		return -1;
+	}
+	pthread_rwlock_rdlock(&namespace_lock);
+	pthread_mutex_lock(&metadata_lock);
+
+	// Print files in specific format
+	printf("FS Ls:\n");
+
+	for (int i = 0; i < root_directory->num_entries; i++) {
+		file_entry_t file_entry = directory_entry(root_directory, i);
+		if (file_entry->filename[0] == 0) {
+			continue;
+		}
+
+		printf("file: %s, size: %d, data_blk: %d\n",
+			file_entry->filename,
+			file_entry->file_size,
+			file_entry->index_first_data_block);
+	}
+
+	pthread_mutex_unlock(&metadata_lock);
+	pthread_rwlock_unlock(&namespace_lock);
+	mount_exit();
+	return 0;
+}
+
+int read_directory(const char *path, size_t *cursor, struct fs_dirent *entries, size_t count) {
+	directory_t dir = resolve_directory(path);
+	if (dir == NULL) {
+		return -1;
+	}
+
+	// Resume from the cursor, which only ever visits the entries of this directory.
+	// The sizes of open files may change until the metadata lock is held
+	pthread_mutex_lock(&metadata_lock);
+	int num_entries = 0;
+	while ((size_t)num_entries < count && *cursor < (size_t)dir->num_entries) {
+		file_entry_t file_entry = directory_entry(dir, (*cursor)++);
+		if (file_entry->filename[0] == 0) {
+			continue;
+		}
+
+		memcpy(entries[num_entries].name, file_entry->filename, FS_FILENAME_LEN);
+		entries[num_entries].name[FS_FILENAME_LEN - 1] = '\0';
+		entries[num_entries].size = file_entry->file_size;
+		entries[num_entries].is_directory = file_entry->type == FILE_TYPE_DIRECTORY;
+		num_entries++;
+	}
+	pthread_mutex_unlock(&metadata_lock);
+
+	return num_entries;
+}
+
+int fs_readdir(const char *path, size_t *cursor, struct fs_dirent *entries, size_t count)
+{
+	// Check if disk is open
+	if (cursor == NULL || entries == NULL || !mount_enter()) {
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&namespace_lock);
+	int ret = read_directory(path, cursor, entries, count);
+	pthread_rwlock_unlock(&namespace_lock);
+	mount_exit();
+	return ret;
+}
+
+int open_path(const char *filename, bool load) {
+	// Files deleted from now on make the lookup below stale
+	uint64_t generation = __atomic_load_n(&namespace_generation, __ATOMIC_ACQUIRE);
+	char name[FS_FILENAME_LEN];
+	directory_t dir = resolve_parent(filename, name, load);
+	if (block_disk_count() == -1 || !validate_file_opening(dir, name)) {
+		return -1;
+	}
+
+	// Find file entry for filename
+	int entry_idx = directory_lookup(dir, name, NULL);
+	if (entry_idx == -1) {
+		return -1;
+	}
+
+	// Take a file descriptor off the free list, growing the table if needed
+	int fd = file_descriptor_alloc();
+	if (fd == -1) {
+		return -1;
+	}
+	file_descriptor_entry_t free_file_descriptor_entry = file_descriptor(fd);
+
+	// Share the inode of the file with its other descriptors, unless the file
+	// may have been deleted since it was found. Deletions check for the inode
+	// with the lock of its bucket held, so it is safe to open once there
+	pthread_mutex_t *inode_bucket_lock = &inode_table_locks[inode_table_bucket(dir, entry_idx)];
+	pthread_mutex_lock(inode_bucket_lock);
+	inode_t inode = NULL;
+	if (__atomic_load_n(&namespace_generation, __ATOMIC_ACQUIRE) == generation) {
+		inode = inode_get(dir, entry_idx);
+	}
+	pthread_mutex_unlock(inode_bucket_lock);
+	if (inode == NULL) {
+		file_descriptor_release(fd);
+		return -1;
+	}
+	int allocation_goal = __atomic_load_n(&free_space->rotor, __ATOMIC_RELAXED);
+
+	// Initialize file descriptor, which is only used once marked open
+	free_file_descriptor_entry->inode = inode;
+	free_file_descriptor_entry->offset = 0;
+	free_file_descriptor_entry->readahead_next = 0;
+	free_file_descriptor_entry->readahead_window = 0;
+	free_file_descriptor_entry->readahead_until = 0;
+	free_file_descriptor_entry->allocation_goal = allocation_goal;
+	free_file_descriptor_entry->cursor_block = -1;
+	free_file_descriptor_entry->transfer_buffers = NULL;
+	free_file_descriptor_entry->transfer_requests = NULL;
+	free_file_descriptor_entry->transfer_capacity = 0;
+	return fd;
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	// Check if disk is open, and validate flags
+	if ((flags & ~FS_OPEN_BUFFERED) != 0 || !mount_enter()) {
+		return -1;
+	}
+
+	// Files are first looked up without lock, through the directories already
+	// loaded. Lookups that need a directory loaded, or that raced with a
+	// deletion, are retried with the namespace lock held
+	int fd = open_path(filename, false);
+	if (fd == -1) {
+		pthread_rwlock_rdlock(&namespace_lock);
+		fd = open_path(filename, true);
+		pthread_rwlock_unlock(&namespace_lock);
+	}
+	if (fd != -1) {
+		file_descriptor_entry_t file = file_descriptor(fd);
+		pthread_mutex_lock(&file->lock);
+		file->buffered = flags & FS_OPEN_BUFFERED;
+		file->is_open = true;
+		pthread_mutex_unlock(&file->lock);
+	}
+	mount_exit();
+	return fd;
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_flags(filename, 0);
+}
+
+file_descriptor_entry_t file_descriptor_enter(int fd) {
+	// Validate that fd is in range and that fd is open, and lock it if so
+	if (!mount_enter()) {
+		return NULL;
+	}
+	if (fd < 0 || fd >= __atomic_load_n(&file_descriptor_table_size, __ATOMIC_ACQUIRE)) {
+		mount_exit();
+		return NULL;
+	}
+	file_descriptor_entry_t file = file_descriptor(fd);
+	pthread_mutex_lock(&file->lock);
+	if (!file->is_open) {
+		pthread_mutex_unlock(&file->lock);
+		mount_exit();
+		return NULL;
+	}
+	return file;
+}
+
+void file_descriptor_exit(file_descriptor_entry_t file) {
+	pthread_mutex_unlock(&file->lock);
+	mount_exit();
+}
+
+void trim_blocks_past_end(directory_t dir, int entry_idx) {
+	// Inline files have no block
+	file_entry_t file_entry = directory_entry(dir, entry_idx);
+	if (file_entry->type == FILE_TYPE_INLINE) {
+		return;
+	}
+
+	// Find the last block holding data, if any
+	int blocks_used = (file_entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int fat_idx = file_entry->index_first_data_block;
+	if (blocks_used == 0) {
+		file_entry->index_first_data_block = FAT_EOC;
+		directory_mark_dirty(dir, entry_idx);
+	} else {
+		for (int i = 1; i < blocks_used; i++) {
+			fat_idx = fat->entries[fat_idx];
+		}
+		int last_fat_idx = fat_idx;
+		fat_idx = fat->entries[last_fat_idx];
+		fat_set_entry(last_fat_idx, FAT_EOC);
+	}
+
+	// Free the rest of the chain
+	while (fat_idx != FAT_EOC) {
+		uint16_t next_fat_idx = fat->entries[fat_idx];
+		cache_invalidate_range(fat_idx + superblock->data_block_start_index, 1);
+		free_space_release(fat_idx);
+		fat_set_entry(fat_idx, 0);
+		fat_idx = next_fat_idx;
+		fat->fat_free++;
+	}
+}
+
+int inode_put(inode_t inode) {
+	// Give back the blocks reserved for the file, and those chained past its
+	// end by failed writes, once nobody uses it. The inode stays in the table
+	// until then, so that the file is not opened again in the meantime
+	int ret = 0;
+	pthread_mutex_t *inode_bucket_lock = &inode_table_locks[inode_table_bucket(inode->directory, inode->entry_idx)];
+	pthread_rwlock_rdlock(&namespace_lock);
+	pthread_mutex_lock(inode_bucket_lock);
+	if (--inode->refcount == 0) {
+		pthread_mutex_lock(&metadata_lock);
+		free_space_unreserve(inode);
+		trim_blocks_past_end(inode->directory, inode->entry_idx);
+		ret = commit_metadata_log(false);
+		pthread_mutex_unlock(&metadata_lock);
+
+		// The small writes are flushed by the close of each descriptor making
+		// them, any still combined are lost and reported as such
+		if (inode->write_buffer_length > 0) {
+			ret = -1;
+		}
+		inode_release(inode);
+	}
+	pthread_mutex_unlock(inode_bucket_lock);
+	pthread_rwlock_unlock(&namespace_lock);
+	return ret;
+}
+
+int file_block_map_lookup(inode_t inode, int block) {
+	// Make room for the block, the map never needs more entries than the FAT has
+	if (block >= inode->block_map_capacity) {
+		int capacity = MIN(MAX(MAX(block + 1, inode->block_map_capacity * 2), BLOCK_MAP_MIN_BLOCKS),
+			fat->num_entries);
+		uint16_t *block_map = realloc(inode->block_map, capacity * sizeof(uint16_t));
+		if (block_map == NULL) {
+			return -1;
+		}
+		__atomic_store_n(&inode->block_map, block_map, __ATOMIC_RELAXED);
+		inode->block_map_capacity = capacity;
+	}
+
+	// Map the blocks up to the one requested, carrying on from the last one mapped
+	int fat_idx = inode->block_map_length == 0
+		? inode->file_entry->index_first_data_block
+		: fat->entries[inode->block_map[inode->block_map_length - 1]];
+	while (inode->block_map_length <= block && fat_idx != FAT_EOC) {
+		inode->block_map[inode->block_map_length++] = fat_idx;
+		fat_idx = fat->entries[fat_idx];
+	}
+
+	return block < inode->block_map_length ? inode->block_map[block] : FAT_EOC;
+}
+
+int file_block_fat_idx(file_descriptor_entry_t file, int block) {
+	// Random accesses go through the block map of the inode, which is built on the first one
+	inode_t inode = file->inode;
+	bool sequential = block == MAX(file->cursor_block, 0) || block == file->cursor_block + 1;
+	int fat_idx = -1;
+	if (__atomic_load_n(&inode->block_map, __ATOMIC_RELAXED) != NULL || !sequential) {
+		pthread_mutex_lock(&inode->block_map_lock);
+		fat_idx = file_block_map_lookup(inode, block);
+		pthread_mutex_unlock(&inode->block_map_lock);
+	}
+
+	// Otherwise walk the FAT chain from the cursor when going forward, from the start if not
+	if (fat_idx == -1) {
+		fat_idx = inode->file_entry->index_first_data_block;
+		int current_block_in_file = 0;
+		if (file->cursor_block != -1 && file->cursor_block <= block) {
+			fat_idx = file->cursor_fat_idx;
+			current_block_in_file = file->cursor_block;
+		}
+		while (current_block_in_file < block && fat_idx != FAT_EOC) {
+			fat_idx = fat->entries[fat_idx];
+			current_block_in_file++;
+		}
+	}
+
+	if (fat_idx != FAT_EOC) {
+		file->cursor_block = block;
+		file->cursor_fat_idx = fat_idx;
+	}
+	return fat_idx;
+}
+
+int file_transfer_reserve(file_descriptor_entry_t file, size_t num_blocks) {
+	// Grow the arrays of the descriptor to describe num_blocks blocks, so that
+	// transfers no longer allocate them once the descriptor is warmed up
+	if (num_blocks <= file->transfer_capacity) {
+		return 0;
+	}
+	size_t capacity = MAX(num_blocks, file->transfer_capacity * 2);
+	void **transfer_buffers = realloc(file->transfer_buffers, capacity * sizeof(void *));
+	if (transfer_buffers == NULL) {
+		return -1;
+	}
+	file->transfer_buffers = transfer_buffers;
+	struct block_request *transfer_requests = realloc(file->transfer_requests,
+		capacity * sizeof(struct block_request));
+	if (transfer_requests == NULL) {
+		return -1;
+	}
+	file->transfer_requests = transfer_requests;
+	file->transfer_capacity = capacity;
+	return 0;
+}
+
+size_t transfer_piece(struct transfer_cursor *cursor, size_t pos, size_t length, uint8_t **data) {
+	// Longest run of at most length bytes from position pos of the transfer
+	// lying in a single segment. Positions only move forward, past empty segments
+	while (pos >= cursor->segment_start + cursor->iov[cursor->segment].iov_len) {
+		cursor->segment_start += cursor->iov[cursor->segment].iov_len;
+		cursor->segment++;
+	}
+	const struct iovec *segment = &cursor->iov[cursor->segment];
+	*data = (uint8_t*)segment->iov_base + (pos - cursor->segment_start);
+	return MIN(length, cursor->segment_start + segment->iov_len - pos);
+}
+
+void transfer_copy(struct transfer_cursor *cursor, size_t pos, uint8_t *data, size_t length, bool to_segments) {
+	while (length > 0) {
+		uint8_t *segment_data;
+		size_t piece = transfer_piece(cursor, pos, length, &segment_data);
+		if (to_segments) {
+			memcpy(segment_data, data, piece);
+		} else {
+			memcpy(data, segment_data, piece);
+		}
+		pos += piece;
+		data += piece;
+		length -= piece;
+	}
+}
+
+void transfer_cursor_rewind(struct transfer_cursor *cursor) {
+	cursor->segment = 0;
+	cursor->segment_start = 0;
+}
+
+bool transfer_block_partial(size_t block, size_t offset_in_block, size_t length) {
+	return (block == 0 && offset_in_block != 0) || (block + 1) * BLOCK_SIZE - offset_in_block > length;
+}
+
+int map_transfer_buffers(void **block_buffers, size_t num_blocks, struct transfer_cursor *cursor,
+	size_t offset_in_block, size_t length, uint8_t **bounce, bool write) {
+	// Block i of the transfer covers positions [i * BLOCK_SIZE - offset_in_block, ...)
+	// Partial blocks are left out (NULL): they go through the buffer cache
+	size_t num_split = 0;
+	for (size_t i = 0; i < num_blocks; i++) {
+		block_buffers[i] = NULL;
+		if (transfer_block_partial(i, offset_in_block, length)) {
+			continue;
+		}
+		uint8_t *data;
+		if (transfer_piece(cursor, i * BLOCK_SIZE - offset_in_block, BLOCK_SIZE, &data) == BLOCK_SIZE) {
+			block_buffers[i] = data;
+		} else {
+			num_split++;
+		}
+	}
+
+	// Full blocks split across segments go through a bounce buffer, gathered
+	// from the segments for writes
+	*bounce = NULL;
+	if (num_split == 0) {
+		return 0;
+	}
+	*bounce = malloc(num_split * BLOCK_SIZE);
+	if (*bounce == NULL) {
 		return -1;
 	}
+	transfer_cursor_rewind(cursor);
+	uint8_t *bounce_block = *bounce;
+	for (size_t i = 0; i < num_blocks; i++) {
+		if (block_buffers[i] != NULL || transfer_block_partial(i, offset_in_block, length)) {
+			continue;
+		}
+		if (write) {
+			transfer_copy(cursor, i * BLOCK_SIZE - offset_in_block, bounce_block, BLOCK_SIZE, false);
+		}
+		block_buffers[i] = bounce_block;
+		bounce_block += BLOCK_SIZE;
+	}
+	return 0;
+}
+
+int cache_transfer(struct transfer_cursor *cursor, size_t pos, size_t disk_block, size_t block_offset,
+	size_t length, bool write, bool overwrite) {
+	// Parts of a block held by different segments are merged one at a time.
+	// Blocks overwritten are not read first, the first part sets them up
+	while (length > 0) {
+		uint8_t *data;
+		size_t piece = transfer_piece(cursor, pos, length, &data);
+		int ret;
+		if (write && overwrite) {
+			ret = cache_overwrite(disk_block, data, block_offset, piece);
+			overwrite = false;
+		} else if (write) {
+			ret = cache_write(disk_block, data, block_offset, piece);
+		} else {
+			ret = cache_read(disk_block, data, block_offset, piece);
+		}
+		if (ret == -1) {
+			return -1;
+		}
+		pos += piece;
+		block_offset += piece;
+		length -= piece;
+	}
+	return 0;
+}
+
+int transfer_block_runs(int fat_idx, void **block_buffers, struct block_request *requests,
+	size_t num_blocks, bool write) {
+	// Turn each physically contiguous run of the FAT chain into one request
+	size_t num_requests = 0;
+	size_t block = 0;
+	while (block < num_blocks && fat_idx != FAT_EOC) {
+		// Skip blocks handled through the buffer cache
+		if (block_buffers[block] == NULL) {
+			fat_idx = fat->entries[fat_idx];
+			block++;
+			continue;
+		}
+
+		int run_start = fat_idx;
+		size_t run_length = 1;
+		fat_idx = fat->entries[fat_idx];
+		while (block + run_length < num_blocks
+			&& block_buffers[block + run_length] != NULL
+			&& fat_idx == run_start + (int)run_length) {
+			fat_idx = fat->entries[fat_idx];
+			run_length++;
+		}
+
+		struct block_request *request = &requests[num_requests++];
+		request->block = run_start + superblock->data_block_start_index;
+		request->count = run_length;
+		request->bufs = &block_buffers[block];
+		request->write = write;
+		block += run_length;
+
+		// Cached copies of blocks written around the cache are stale
+		if (write) {
+			cache_invalidate_range(request->block, run_length);
+		}
+	}
 
-	// Find file from root directory
-	file_entry_t file_entry = NULL;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp(root_directory[i].filename, filename) == 0) {
-			file_entry = &root_directory[i];
-			break;
+	// Keep all the runs in flight at once, unless there is only one of them
+	int ret = 0;
+	if (num_requests > 1 && block_submit(requests, num_requests) == 0) {
+		block_reap(requests, num_requests, true);
+		for (size_t i = 0; i < num_requests; i++) {
+			if (requests[i].result == -1) {
+				ret = -1;
+			}
+		}
+	} else {
+		for (size_t i = 0; i < num_requests && ret == 0; i++) {
+			ret = write
+				? block_writev(requests[i].block, (const void **)requests[i].bufs, requests[i].count)
+				: block_readv(requests[i].block, requests[i].bufs, requests[i].count);
+		}
+	}
+	return ret;
+}
 
+void inline_transfer(file_descriptor_entry_t file, uint8_t *buf, size_t offset, size_t length, bool write) {
+	// Byte i of an inline file is in the i / INLINE_ENTRY_BYTES entry of its run
+	while (length > 0) {
+		int entry_idx = file->inode->file_entry->inline_entry + offset / INLINE_ENTRY_BYTES;
+		struct inline_entry *inline_entry = (struct inline_entry*) directory_entry(file->inode->directory, entry_idx);
+		size_t entry_offset = offset % INLINE_ENTRY_BYTES;
+		size_t entry_length = MIN(length, INLINE_ENTRY_BYTES - entry_offset);
+		if (write) {
+			memcpy(&inline_entry->data[entry_offset], buf, entry_length);
+			directory_mark_dirty(file->inode->directory, entry_idx);
+		} else {
+			memcpy(buf, &inline_entry->data[entry_offset], entry_length);
 		}
+		buf += entry_length;
+		offset += entry_length;
+		length -= entry_length;
+	}
+}
+
+bool inline_fits(inode_t inode, size_t size) {
+	// Only empty files without blocks become inline, as long as they stay small
+	file_entry_t file_entry = inode->file_entry;
+	if (superblock->inline_signature != INLINE_SIGNATURE || size > INLINE_MAX_SIZE) {
+		return false;
 	}
+	return file_entry->type == FILE_TYPE_INLINE
+		|| (file_entry->file_size == 0 && file_entry->index_first_data_block == FAT_EOC);
+}
 
-	// Return error if no file was found in directory
-	if (file_entry == NULL) {
-		return -1;
+bool inline_grow(file_descriptor_entry_t file, size_t size) {
+	file_entry_t file_entry = file->inode->file_entry;
+	if (!inline_fits(file->inode, size)) {
+		return false;
 	}
 
-	// Make sure file is not currently open
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (file_descriptor_table[i]->is_open &&
-			strcmp(file_descriptor_table[i]->file_entry->filename, filename) == 0) {
-				return -1;
+	// Extend the run of entries holding the data in place if the next entries
+	// are unused, or move it to a run large enough, growing the directory if needed
+	directory_t dir = file->inode->directory;
+	int num_entries = file_entry->type == FILE_TYPE_INLINE ? inline_entries(file_entry->file_size) : 0;
+	int entries_needed = inline_entries(size);
+	if (entries_needed > num_entries
+		&& (num_entries == 0
+			|| !directory_reserve_entries(dir, file_entry->inline_entry + num_entries, entries_needed - num_entries))) {
+		int first = directory_free_run(dir, entries_needed);
+		if (first == -1) {
+			if (directory_grow(dir) == -1) {
+				return false;
 			}
+			first = directory_free_run(dir, entries_needed);
+		}
+		directory_reserve_entries(dir, first, entries_needed);
+
+		uint8_t data[INLINE_MAX_SIZE];
+		inline_transfer(file, data, 0, file_entry->file_size, false);
+		directory_release_entries(dir, file_entry->inline_entry, num_entries);
+		file_entry->inline_entry = first;
+		inline_transfer(file, data, 0, file_entry->file_size, true);
+		directory_mark_dirty(dir, file->inode->entry_idx);
 	}
+	if (file_entry->type != FILE_TYPE_INLINE) {
+		file_entry->type = FILE_TYPE_INLINE;
+		directory_mark_dirty(dir, file->inode->entry_idx);
+	}
+	return true;
+}
 
-	// Clear FAT chain
-	int fat_idx = file_entry->index_first_data_block;
-	while (fat_idx != FAT_EOC) {
-		uint16_t next_fat_idx = fat->entries[fat_idx];
-		fat->entries[fat_idx] = 0;
-		fat_idx = next_fat_idx;
-		fat->fat_free++;
+int inline_demote(file_descriptor_entry_t file) {
+	// Move the data of the file to a block of its own, if there is one left
+	file_entry_t file_entry = file->inode->file_entry;
+	int extent_length;
+	int fat_idx = free_space_allocate_extent(file->allocation_goal, 1, &extent_length);
+	if (fat_idx == -1) {
+		return -1;
 	}
 
-	// Clear Root Entry
-	file_entry->filename[0] = 0;
-	file_entry->file_size = 0;
-	file_entry->index_first_data_block = 0;
-	num_files_total--;
+	uint8_t block[BLOCK_SIZE] = {0};
+	inline_transfer(file, block, 0, file_entry->file_size, false);
+	if (cache_write(fat_idx + superblock->data_block_start_index, block, 0, BLOCK_SIZE) == -1) {
+		free_space_release(fat_idx);
+		return -1;
+	}
+	directory_release_entries(file->inode->directory, file_entry->inline_entry, inline_entries(file_entry->file_size));
+
+	fat_set_entry(fat_idx, FAT_EOC);
+	fat->fat_free--;
+	file_entry->index_first_data_block = fat_idx;
+	file_entry->type = FILE_TYPE_REGULAR;
+	file_entry->inline_entry = 0;
+	directory_mark_dirty(file->inode->directory, file->inode->entry_idx);
+	file->inode->num_blocks = 1;
+	file->inode->tail_fat_idx = fat_idx;
+	file->allocation_goal = fat_idx + 1;
 	return 0;
 }
 
-int fs_ls(void)
-{
-	// Check if disk is open
-	if (!disk_open) {
+size_t transfer_length(const struct iovec *iov, int iovcnt) {
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		length += iov[i].iov_len;
+	}
+	return length;
+}
+
+void inline_transfer_segments(file_descriptor_entry_t file, struct transfer_cursor *cursor, size_t length, bool write) {
+	for (size_t pos = 0; pos < length; ) {
+		uint8_t *data;
+		size_t piece = transfer_piece(cursor, pos, length - pos, &data);
+		inline_transfer(file, data, file->offset + pos, piece, write);
+		pos += piece;
+	}
+}
+
+int file_write(file_descriptor_entry_t file, const struct iovec *iov, int iovcnt) {
+	// The data is gathered from the segments as the blocks are written
+	struct transfer_cursor cursor = { .iov = iov, .iovcnt = iovcnt };
+	size_t count = transfer_length(iov, iovcnt);
+
+	// If the count is 0, then no point doing anything: just return 0 bytes written
+	if (count == 0) {
+		return 0;
+	}
+
+	// Descriptors are left past the end of the file by the small writes that
+	// could not be flushed, and files have no holes
+	if (file->offset > (int)file->inode->file_entry->file_size) {
 		return -1;
 	}
 
-	// Print files in specific format
-	printf("FS Ls:\n");
+	int offset_in_block = file->offset%BLOCK_SIZE;
+	int start_block_location = file->offset/BLOCK_SIZE;
+	size_t bytes_written = 0;
+	size_t bytes_left_to_write;
+
+	// Small files are stored in the directory entries following their own,
+	// and move to data blocks once they outgrow them
+	pthread_mutex_lock(&metadata_lock);
+	if (inline_grow(file, file->offset + count)) {
+		inline_transfer_segments(file, &cursor, count, true);
+		file->offset += count;
+		if (file->offset > (int)file->inode->file_entry->file_size) {
+			file->inode->file_entry->file_size = file->offset;
+			directory_mark_dirty(file->inode->directory, file->inode->entry_idx);
+		}
+		int ret = commit_metadata_log(false);
+		pthread_mutex_unlock(&metadata_lock);
+		return ret == -1 ? -1 : (int)count;
+	}
+	if (file->inode->file_entry->type == FILE_TYPE_INLINE && inline_demote(file) == -1) {
+		pthread_mutex_unlock(&metadata_lock);
+		return 0;
+	}
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root_directory[i].filename[0] == 0) {
-			continue;
+	// The inode knows how many blocks are chained to the file and which is the last
+	inode_t inode = file->inode;
+	if (inode->num_blocks == -1) {
+		inode_count_blocks(inode);
+	}
+	int last_fat_block_id = inode->tail_fat_idx;
+	int num_file_blocks = inode->num_blocks;
+
+	// Extend the chain with the blocks the write needs, as long as there are free ones.
+	// Extents are placed right after the tail of the file whenever possible, or
+	// at the goal of the descriptor for files that have no block yet. Growing files
+	// reserve a few more blocks than needed so that their next appends stay contiguous
+	int blocks_needed = (file->offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int blocks_preallocated = MIN(blocks_needed, PREALLOCATION_MAX_BLOCKS);
+	while (num_file_blocks < blocks_needed) {
+		int extent_start;
+		int extent_length;
+		if (inode->reserved_length > 0) {
+			extent_start = inode->reserved_start;
+			extent_length = MIN(inode->reserved_length, blocks_needed - num_file_blocks);
+			inode->reserved_start += extent_length;
+			inode->reserved_length -= extent_length;
+		} else {
+			int goal = last_fat_block_id == FAT_EOC ? file->allocation_goal : last_fat_block_id + 1;
+			extent_start = free_space_allocate_extent(goal,
+				blocks_needed + blocks_preallocated - num_file_blocks, &extent_length);
+			if (extent_start == -1) {
+				break;
+			}
+			int extent_used = MIN(extent_length, blocks_needed - num_file_blocks);
+			if (extent_length > extent_used) {
+				free_space_reserve(inode, extent_start + extent_used, extent_length - extent_used);
+			}
+			extent_length = extent_used;
 		}
 
-		printf("file: %s, size: %d, data_blk: %d\n",
-			root_directory[i].filename,
-			root_directory[i].file_size,
-			root_directory[i].index_first_data_block);
+		for (int free_fat_idx = extent_start; free_fat_idx < extent_start + extent_length; free_fat_idx++) {
+			fat_set_entry(free_fat_idx, FAT_EOC);
+			if (last_fat_block_id == FAT_EOC) {
+				file->inode->file_entry->index_first_data_block = free_fat_idx;
+				directory_mark_dirty(file->inode->directory, file->inode->entry_idx);
+			} else {
+				fat_set_entry(last_fat_block_id, free_fat_idx);
+			}
+			last_fat_block_id = free_fat_idx;
+			num_file_blocks++;
+			fat->fat_free--;
+		}
+		file->allocation_goal = last_fat_block_id + 1;
+		inode->tail_fat_idx = last_fat_block_id;
+		inode->num_blocks = num_file_blocks;
+	}
+	pthread_mutex_unlock(&metadata_lock);
+
+	// When out of space, only write what fits in the blocks of the file
+	bytes_left_to_write = MIN(count, (size_t)num_file_blocks * BLOCK_SIZE - file->offset);
+
+	if (bytes_left_to_write == 0) {
+		return 0;
+	}
+
+	// fat blocks are now set up, so just left to write
+	int fat_idx = file_block_fat_idx(file, start_block_location);
+
+	// Full blocks are written straight from the segments
+	size_t num_blocks = (offset_in_block + bytes_left_to_write + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint8_t *bounce;
+	if (file_transfer_reserve(file, num_blocks) == -1
+		|| map_transfer_buffers(file->transfer_buffers, num_blocks, &cursor, offset_in_block,
+			bytes_left_to_write, &bounce, true) == -1) {
+		return -1;
 	}
+	void **block_buffers = file->transfer_buffers;
+
+	// Partial head and tail blocks are merged into the buffer cache. Those
+	// whose data is all overwritten, or that hold none yet, are not read first
+	transfer_cursor_rewind(&cursor);
+	size_t file_size = file->inode->file_entry->file_size;
+	int last_fat_idx = fat_idx;
+	int transfer_ret = 0;
+	for (size_t i = 0; i < num_blocks && transfer_ret == 0; i++) {
+		if (i > 0) {
+			last_fat_idx = fat->entries[last_fat_idx];
+		}
+		if (block_buffers[i] == NULL) {
+			size_t block_offset = i == 0 ? offset_in_block : 0;
+			size_t input_offset = i == 0 ? 0 : i * BLOCK_SIZE - offset_in_block;
+			size_t length = MIN(BLOCK_SIZE - block_offset, bytes_left_to_write - input_offset);
+			size_t block_start = (size_t)(start_block_location + i) * BLOCK_SIZE;
+			size_t block_data = file_size > block_start ? MIN(file_size - block_start, BLOCK_SIZE) : 0;
+			bool overwrite = block_data == 0 || (block_offset == 0 && length >= block_data);
+			transfer_ret = cache_transfer(&cursor, input_offset, last_fat_idx + superblock->data_block_start_index,
+				block_offset, length, true, overwrite);
+		}
+	}
+
+	// Write each contiguous run of the FAT chain with a single call
+	if (transfer_ret == 0) {
+		transfer_ret = transfer_block_runs(fat_idx, block_buffers, file->transfer_requests, num_blocks, true);
+	}
+
+	free(bounce);
+
+	// Failed writes leave the offset and the size of the file alone, the
+	// blocks they got are trimmed once the file is closed
+	if (transfer_ret == -1) {
+		return -1;
+	}
+
+	file->cursor_block = start_block_location + num_blocks - 1;
+	file->cursor_fat_idx = last_fat_idx;
+
+	bytes_written = bytes_left_to_write;
+	file->offset += bytes_written;
+	pthread_mutex_lock(&metadata_lock);
+	if (file->offset > (int)file->inode->file_entry->file_size) {
+		file->inode->file_entry->file_size = file->offset;
+		directory_mark_dirty(file->inode->directory, file->inode->entry_idx);
+	}
+
+	// Only report the write once its metadata is committed
+	int ret = commit_metadata_log(false);
+	pthread_mutex_unlock(&metadata_lock);
+	if (ret == -1) {
+		return -1;
+	}
+	return bytes_written;
+}
+
+int file_write_namespace(file_descriptor_entry_t file, const struct iovec *iov, int iovcnt) {
+	// Writes storing or moving inline data change the entries of the
+	// directory, and exclude any other access to the directories as well
+	inode_t inode = file->inode;
+	if (inode->file_entry->type == FILE_TYPE_INLINE
+		|| inline_fits(inode, file->offset + transfer_length(iov, iovcnt))) {
+		pthread_rwlock_wrlock(&namespace_lock);
+	} else {
+		pthread_rwlock_rdlock(&namespace_lock);
+	}
+	int ret = file_write(file, iov, iovcnt);
+	pthread_rwlock_unlock(&namespace_lock);
+	return ret;
+}
 
+int file_write_combined(file_descriptor_entry_t file) {
+	// Write the small writes combined in the buffer of the inode, or as much
+	// of them as fits on disk, through any descriptor of the file
+	inode_t inode = file->inode;
+	if (inode->write_buffer_length == 0) {
+		return 0;
+	}
+	struct iovec iov = { .iov_base = inode->write_buffer, .iov_len = inode->write_buffer_length };
+	int length = inode->write_buffer_length;
+	int offset = file->offset;
+	__atomic_store_n(&inode->write_buffer_length, 0, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&num_write_buffers_pending, 1, __ATOMIC_RELAXED);
+	file->offset = inode->write_buffer_offset;
+	int ret = file_write_namespace(file, &iov, 1);
+	file->offset = offset;
+	if (ret != length) {
+		__atomic_store_n(&inode->write_buffer_failed, true, __ATOMIC_RELAXED);
+		return -1;
+	}
 	return 0;
 }
 
-int fs_open(const char *filename)
-{
-	if (!disk_open
-		|| block_disk_count() == -1
-		|| !validate_file_opening(filename)) {
+int file_write_exclusive(file_descriptor_entry_t file, const struct iovec *iov, int iovcnt) {
+	// Writes exclude any other access to the file, and go after the small
+	// writes combined so far
+	inode_t inode = file->inode;
+	pthread_rwlock_wrlock(&inode->lock);
+	int ret = file_write_combined(file);
+	if (ret == 0) {
+		ret = file_write_namespace(file, iov, iovcnt);
+	}
+	pthread_rwlock_unlock(&inode->lock);
+	return ret;
+}
+
+int file_write_flush(file_descriptor_entry_t file) {
+	// Write the small writes combined for the file, if there are any
+	inode_t inode = file->inode;
+	if (__atomic_load_n(&inode->write_buffer_length, __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+	pthread_rwlock_wrlock(&inode->lock);
+	int ret = file_write_combined(file);
+	pthread_rwlock_unlock(&inode->lock);
+	return ret;
+}
+
+int file_write_buffered(file_descriptor_entry_t file, const struct iovec *iov, int iovcnt) {
+	// Once the small writes to the file could not all be written, the ones
+	// that follow are refused rather than reported written and lost as well
+	inode_t inode = file->inode;
+	if (__atomic_load_n(&inode->write_buffer_failed, __ATOMIC_RELAXED)) {
 		return -1;
 	}
 
-	// Find free file descriptor
-	file_descriptor_entry_t free_file_descriptor_entry = NULL;
-	for (int fd = 0; fd < FILE_NUM; fd++) {
-		if (!file_descriptor_table[fd]->is_open) {
-			free_file_descriptor_entry = file_descriptor_table[fd];
-			break;
-		}
+	// Writes of whole blocks gain nothing from being combined, and the small
+	// writes combined so far only take those continuing them
+	size_t count = transfer_length(iov, iovcnt);
+	if (count >= BLOCK_SIZE) {
+		return file_write_exclusive(file, iov, iovcnt);
+	}
+	pthread_rwlock_wrlock(&inode->lock);
+	if (inode->write_buffer_length > 0
+		&& file->offset != inode->write_buffer_offset + inode->write_buffer_length
+		&& file_write_combined(file) == -1) {
+		pthread_rwlock_unlock(&inode->lock);
+		return -1;
 	}
 
-	if (free_file_descriptor_entry == NULL) {
+	// Files have no holes, so nothing is combined past their end
+	if (inode->write_buffer_length == 0 && file->offset > (int)inode->file_entry->file_size) {
+		pthread_rwlock_unlock(&inode->lock);
 		return -1;
 	}
+	if (inode->write_buffer == NULL) {
+		inode->write_buffer = malloc(BLOCK_SIZE);
+		if (inode->write_buffer == NULL) {
+			int ret = file_write_namespace(file, iov, iovcnt);
+			pthread_rwlock_unlock(&inode->lock);
+			return ret;
+		}
+	}
 
-	// Find file entry for filename
-	file_entry_t file_entry = NULL;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp(root_directory[i].filename, filename) == 0) {
-			file_entry = &root_directory[i];
+	// Fill the buffer up to the end of the block of the file it covers, then
+	// flush it, so that blocks past the first one are written whole. The
+	// offset of the descriptor moves past the bytes right away
+	int ret = count;
+	struct transfer_cursor cursor = { .iov = iov, .iovcnt = iovcnt };
+	for (size_t pos = 0; pos < count; ) {
+		// Only bytes going to a data block the file already has are combined,
+		// so that running out of room is reported by the write that needs
+		// the block. The others, and those of inline files, are written now
+		size_t file_size = inode->file_entry->file_size;
+		if (inode->write_buffer_length == 0
+			&& (inode->file_entry->type == FILE_TYPE_INLINE
+				|| (size_t)file->offset >= (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)) {
+			transfer_copy(&cursor, pos, inode->write_buffer, count - pos, false);
+			struct iovec rest = { .iov_base = inode->write_buffer, .iov_len = count - pos };
+			int written = file_write_namespace(file, &rest, 1);
+			if (written == -1) {
+				ret = pos > 0 ? (int)pos : -1;
+			} else {
+				ret = pos + written;
+			}
+			break;
+		}
+		if (inode->write_buffer_length == 0) {
+			inode->write_buffer_offset = file->offset;
+			__atomic_add_fetch(&num_write_buffers_pending, 1, __ATOMIC_RELAXED);
+		}
+		size_t buffer_end = (inode->write_buffer_offset % BLOCK_SIZE) + inode->write_buffer_length;
+		size_t length = MIN(BLOCK_SIZE - buffer_end, count - pos);
+		transfer_copy(&cursor, pos, &inode->write_buffer[inode->write_buffer_length], length, false);
+		__atomic_store_n(&inode->write_buffer_length, inode->write_buffer_length + length, __ATOMIC_RELAXED);
+		file->offset += length;
+		pos += length;
+		if (buffer_end + length == BLOCK_SIZE && file_write_combined(file) == -1) {
+			ret = -1;
 			break;
 		}
 	}
+	pthread_rwlock_unlock(&inode->lock);
+	return ret;
+}
+
+int flush_write_buffers() {
+	// Flush the small writes of every file, unless there are none
+	int ret = 0;
+	if (__atomic_load_n(&num_write_buffers_pending, __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+	int table_size = __atomic_load_n(&file_descriptor_table_size, __ATOMIC_ACQUIRE);
+	for (int fd = 0; fd < table_size; fd++) {
+		file_descriptor_entry_t file = file_descriptor(fd);
+		pthread_mutex_lock(&file->lock);
+		if (file->is_open && file_write_flush(file) == -1) {
+			ret = -1;
+		}
+		pthread_mutex_unlock(&file->lock);
+	}
+	return ret;
+}
+
+bool validate_iovec(const struct iovec *iov, int iovcnt) {
+	// Every segment needs a buffer, even empty ones as with fs_read() and fs_write()
+	if (iov == NULL || iovcnt < 0) {
+		return false;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_base == NULL) {
+			return false;
+		}
+	}
+	return true;
+}
 
-	if (file_entry == NULL) {
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	// Error checking
+	if (!validate_iovec(iov, iovcnt)) {
+		return -1;
+	}
+	file_descriptor_entry_t file = file_descriptor_enter(fd);
+	if (file == NULL) {
 		return -1;
 	}
 
-	// Initialize file descriptor
-	free_file_descriptor_entry->file_entry = file_entry;
-	free_file_descriptor_entry->is_open = true;
-	free_file_descriptor_entry->offset = 0;
-	num_files_open++;
-	return free_file_descriptor_entry->fd;
+	int ret = file->buffered
+		? file_write_buffered(file, iov, iovcnt)
+		: file_write_exclusive(file, iov, iovcnt);
+	file_descriptor_exit(file);
+	return ret;
 }
 
-bool validate_fd(int fd) {
-	// Validate that fd is in range and that fd is open
-	return fd >= 0 && fd < FILE_NUM && file_descriptor_table[fd]->is_open;
+int fs_write(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	return fs_writev(fd, &iov, 1);
 }
 
 int fs_close(int fd)
 {
-	// Check if disk is open
-	if (!disk_open) {
+	// Check if disk is open, and validate fd
+	file_descriptor_entry_t file = file_descriptor_enter(fd);
+	if (file == NULL) {
 		return -1;
 	}
 
-	// Validate fd
-	if (!validate_fd(fd)) {
-		return -1;
+	// Close fd, once the small writes to the file are flushed
+	int ret = file_write_flush(file);
+	file->is_open = false;
+	while (__atomic_load_n(&file->positional_calls, __ATOMIC_ACQUIRE) > 0) {
+		sched_yield();
+	}
+	free(file->transfer_buffers);
+	free(file->transfer_requests);
+	file->transfer_buffers = NULL;
+	file->transfer_requests = NULL;
+	file->transfer_capacity = 0;
+	inode_t inode = file->inode;
+	file->inode = NULL;
+	if (inode_put(inode) == -1) {
+		ret = -1;
 	}
 
-	// Close fd
-	file_descriptor_table[fd]->is_open = false;
-	num_files_open--;
-	return 0;
+	file_descriptor_exit(file);
+	file_descriptor_release(fd);
+	return ret;
 }
 
-int fs_stat(int fd)
+int fs_fsync(int fd)
 {
-	// Check if disk is open
-	if (!disk_open) {
+	// Check if disk is open, and validate fd
+	file_descriptor_entry_t file = file_descriptor_enter(fd);
+	if (file == NULL) {
 		return -1;
 	}
 
-	// Validate fd
-	if (!validate_fd(fd)) {
-		return -1;
+	// The FAT and root directory are shared by all files, so this is a full sync
+	int ret = file_write_flush(file);
+	if (sync_disk() == -1) {
+		ret = -1;
 	}
-
-	return file_descriptor_table[fd]->file_entry->file_size;
+	file_descriptor_exit(file);
+	return ret;
 }
 
-int fs_lseek(int fd, size_t offset)
+int fs_stat(int fd)
 {
-	// Check if disk is open
-	if (!disk_open) {
+	// Check if disk is open, and validate fd
+	file_descriptor_entry_t file = file_descriptor_enter(fd);
+	if (file == NULL) {
 		return -1;
 	}
 
-	// Validate fd
-	if (!validate_fd(fd)) {
+	// The size includes the small writes to the file
+	if (file_write_flush(file) == -1) {
+		file_descriptor_exit(file);
 		return -1;
 	}
+	pthread_rwlock_rdlock(&file->inode->lock);
+	int size = file->inode->file_entry->file_size;
+	pthread_rwlock_unlock(&file->inode->lock);
+	file_descriptor_exit(file);
+	return size;
+}
 
-	// Validate offset
-	if (offset > file_descriptor_table[fd]->file_entry->file_size) {
+int fs_lseek(int fd, size_t offset)
+{
+	// Check if disk is open, and validate fd
+	file_descriptor_entry_t file = file_descriptor_enter(fd);
+	if (file == NULL) {
 		return -1;
 	}
 
-	file_descriptor_table[fd]->offset = offset;
-	return 0;
+	// Validate offset, the file ending past the small writes not flushed yet
+	inode_t inode = file->inode;
+	pthread_rwlock_rdlock(&inode->lock);
+	int ret = -1;
+	size_t file_size = inode->file_entry->file_size;
+	if (inode->write_buffer_length > 0) {
+		file_size = MAX(file_size, (size_t)inode->write_buffer_offset + inode->write_buffer_length);
+	}
+	if (offset <= file_size) {
+		file->offset = offset;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&inode->lock);
+	file_descriptor_exit(file);
+	return ret;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+int fs_sync(void)
 {
-	// Error checking
-	if (!disk_open || !validate_fd(fd) || buf == NULL) {
+	// Ensure disk is open
+	if (!mount_enter()) {
 		return -1;
 	}
-	uint8_t *input_buffer = (uint8_t*)buf;
 
-	// If the count is 0, then no point doing anything: just return 0 bytes written
-	if (count == 0) {
-		return 0;
+	int ret = flush_write_buffers();
+	if (sync_disk() == -1) {
+		ret = -1;
 	}
+	mount_exit();
+	return ret;
+}
 
-	file_descriptor_entry_t file = file_descriptor_table[fd];
-	int offset_in_block = file->offset%BLOCK_SIZE;
-	int start_block_location = file->offset/BLOCK_SIZE;
-	size_t bytes_written = 0;
-	size_t bytes_left_to_write = count;
-	size_t input_buffer_index = 0;
-
-	// First check if we need to add data/FAT blocks
-	int blocks_to_add = (offset_in_block + count - 1)/BLOCK_SIZE;
-	bool new_file = false;
-	if (file->file_entry->index_first_data_block == FAT_EOC) {
-		// file was empty, needs an initial block
-		blocks_to_add++;
-		new_file = true;
-		//printf("it is a new file\n");
-	}
-	int fat_idx = file->file_entry->index_first_data_block;
-	int last_fat_block_id = 0;
-	while (fat_idx != FAT_EOC) {
-		last_fat_block_id = fat_idx;
-		fat_idx = fat->entries[fat_idx];
+void file_readahead(file_descriptor_entry_t file, int read_offset, int last_block, int last_fat_idx) {
+	// Sequential reads grow the readahead window, anything else resets it
+	if (read_offset == file->readahead_next) {
+		file->readahead_window = file->readahead_window == 0
+			? READAHEAD_MIN_BLOCKS
+			: MIN(file->readahead_window * 2, READAHEAD_MAX_BLOCKS);
+	} else {
+		file->readahead_window = 0;
+		file->readahead_until = 0;
 	}
-	int fat_search_index = 0;
-	size_t bytes_to_write_in_last_block = (offset_in_block + count)%BLOCK_SIZE;
-	while (blocks_to_add > 0) {
-		// first search for empty fat block to take
-		while (fat->entries[fat_search_index] > 0 && fat_search_index < superblock->num_data_blocks) {
-			fat_search_index++;
-		}
-		if (fat_search_index >= superblock->num_data_blocks) {
-			// out of memory to write to, so reduce the number of bytes left to write
-			while (blocks_to_add > 1) {
-				bytes_left_to_write -= BLOCK_SIZE;
-				blocks_to_add--;
-			}
-			bytes_left_to_write -= bytes_to_write_in_last_block;
-			blocks_to_add--;
-		}
-		else {
-			//add a new block
-			if (new_file) {
-				fat->entries[fat_search_index] = FAT_EOC;
-				file->file_entry->index_first_data_block = fat_search_index;
-				last_fat_block_id = fat_search_index;
-				new_file = false;
-			}
-			else {
-				fat->entries[last_fat_block_id] = fat_search_index;
-				last_fat_block_id = fat_search_index;
-				fat->entries[last_fat_block_id] = FAT_EOC;
-			}
-			fat->fat_free--;
-			blocks_to_add--;
-		}
+	file->readahead_next = file->offset;
+
+	if (file->readahead_window == 0) {
+		return;
 	}
 
-	// fat blocks are now set up, so just left to write
-	fat_idx = file->file_entry->index_first_data_block;
-	int current_block_in_file = 0;
-	//printf("start block: %d\n", start_block_location);
-	while (current_block_in_file < start_block_location) {
-		fat_idx = fat->entries[fat_idx];
-		current_block_in_file++;
+	// Only start new reads once less than half of the window is left ahead
+	int first_block = last_block + 1;
+	if (file->readahead_until - first_block >= file->readahead_window / 2) {
+		return;
 	}
 
-	uint8_t* buffer = malloc(BLOCK_SIZE);
+	int file_blocks = (file->inode->file_entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int until = MIN(first_block + file->readahead_window, file_blocks);
+	int start = MAX(first_block, file->readahead_until);
+	if (start >= until) {
+		return;
+	}
 
-	int block_write_start = offset_in_block;
-	int block_write_finish = offset_in_block + bytes_left_to_write;
-	if (block_write_finish > BLOCK_SIZE) {
-		block_write_finish = BLOCK_SIZE;
+	int fat_idx = fat->entries[last_fat_idx];
+	for (int block = first_block; block < start && fat_idx != FAT_EOC; block++) {
+		fat_idx = fat->entries[fat_idx];
 	}
-	//printf("bytes to write: %lu\n", bytes_left_to_write);
-	while (bytes_left_to_write > 0) {
-		int block_write_amount = block_write_finish - block_write_start;
-		block_read(fat_idx + superblock->data_block_start_index, buffer);
-		memcpy(&buffer[block_write_start], &input_buffer[input_buffer_index], block_write_amount);
-		block_write(fat_idx + superblock->data_block_start_index, buffer);
-		file->offset += block_write_amount;
-		if (file->offset > (int)file->file_entry->file_size) {
-			file->file_entry->file_size = file->offset;
-		}
-		input_buffer_index += block_write_amount;
-		bytes_written += block_write_amount;
-		bytes_left_to_write -= block_write_amount;
+
+	size_t blocks[READAHEAD_MAX_BLOCKS];
+	size_t num_blocks = 0;
+	for (int block = start; block < until && fat_idx != FAT_EOC; block++) {
+		blocks[num_blocks++] = fat_idx + superblock->data_block_start_index;
 		fat_idx = fat->entries[fat_idx];
-		block_write_start = 0;
-		block_write_finish = bytes_left_to_write;
-		if (block_write_finish > BLOCK_SIZE) {
-			block_write_finish = BLOCK_SIZE;
-		}
 	}
-	free(buffer);
-	return bytes_written;
+
+	cache_prefetch(blocks, num_blocks);
+	file->readahead_until = until;
 }
 
-int fs_read(int fd, void *buf, size_t count)
-{
-	// Error checking
-	if (!disk_open || !validate_fd(fd) || buf == NULL) {
-		return -1;
-	}
-	uint8_t *output_buffer = (uint8_t*)buf;
+int file_read(file_descriptor_entry_t file, const struct iovec *iov, int iovcnt) {
+	// The data is scattered to the segments as the blocks are read
+	struct transfer_cursor cursor = { .iov = iov, .iovcnt = iovcnt };
+	size_t count = transfer_length(iov, iovcnt);
+
 	// If the count is 0, then no point doing anything: just return 0 bytes read
 	if (count == 0) {
 		return 0;
 	}
 
-	file_descriptor_entry_t file = file_descriptor_table[fd];
 	int offset_in_block = file->offset%BLOCK_SIZE;
 	//what block is the offset in
 	//previously file_offset_block_location
 	int start_block_location = file->offset/BLOCK_SIZE; //divided 2 ints will return only the quotient
 	size_t bytes_read = 0;
 	size_t bytes_left_to_read = count;
-	if (count > file->file_entry->file_size - file->offset) {
+	if (file->offset >= (int)file->inode->file_entry->file_size) {
+		return 0;
+	}
+	if (count > file->inode->file_entry->file_size - file->offset) {
 		//count is more than there are bytes to read
-		bytes_left_to_read = file->file_entry->file_size - file->offset;
+		bytes_left_to_read = file->inode->file_entry->file_size - file->offset;
+	}
+
+	if (bytes_left_to_read == 0) {
+		return 0;
+	}
+
+	// Inline files are read from the directory entries following their own,
+	// which are only changed by the writes of the file
+	if (file->inode->file_entry->type == FILE_TYPE_INLINE) {
+		inline_transfer_segments(file, &cursor, bytes_left_to_read, false);
+		file->offset += bytes_left_to_read;
+		return bytes_left_to_read;
 	}
-	size_t output_buffer_index = 0;
 
 	//first get the data block index of the offset
-	int fat_idx = file->file_entry->index_first_data_block;
-	int current_block_in_file = 0;
-	while (current_block_in_file < start_block_location) {
-		fat_idx = fat->entries[fat_idx];
-		current_block_in_file++;
+	int fat_idx = file_block_fat_idx(file, start_block_location);
+
+	// Blocks held by the buffer cache are served from it, the others straight from disk
+	size_t num_blocks = (offset_in_block + bytes_left_to_read + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint8_t *bounce;
+	if (file_transfer_reserve(file, num_blocks) == -1
+		|| map_transfer_buffers(file->transfer_buffers, num_blocks, &cursor, offset_in_block,
+			bytes_left_to_read, &bounce, false) == -1) {
+		return -1;
 	}
-	uint8_t *buffer = malloc(BLOCK_SIZE);
+	void **block_buffers = file->transfer_buffers;
 
-	int block_read_start = offset_in_block;
-	int block_read_finish = offset_in_block + bytes_left_to_read;
-	if (block_read_finish > BLOCK_SIZE) {
-		//going to have to read across multiple blocks. for now, set it to the max
-		block_read_finish = BLOCK_SIZE;
+	transfer_cursor_rewind(&cursor);
+	int last_fat_idx = fat_idx;
+	int transfer_ret = 0;
+	for (size_t i = 0; i < num_blocks && transfer_ret == 0; i++) {
+		if (i > 0) {
+			last_fat_idx = fat->entries[last_fat_idx];
+		}
+		size_t disk_block = last_fat_idx + superblock->data_block_start_index;
+		size_t block_offset = i == 0 ? offset_in_block : 0;
+		size_t output_offset = i == 0 ? 0 : i * BLOCK_SIZE - offset_in_block;
+		size_t length = MIN(BLOCK_SIZE - block_offset, bytes_left_to_read - output_offset);
+
+		// Partial blocks always go through the cache, full ones only if already
+		// there. Bounced blocks are scattered to the segments once read
+		uint8_t *data;
+		if (block_buffers[i] == NULL) {
+			transfer_ret = cache_transfer(&cursor, output_offset, disk_block, block_offset, length, false, false);
+		} else if (cache_peek(disk_block, block_buffers[i], 0, BLOCK_SIZE) == 1) {
+			if (transfer_piece(&cursor, output_offset, BLOCK_SIZE, &data) < BLOCK_SIZE) {
+				transfer_copy(&cursor, output_offset, block_buffers[i], BLOCK_SIZE, true);
+			}
+			block_buffers[i] = NULL;
+		}
 	}
 
-	while (bytes_left_to_read > 0) {
-		int block_read_amount = block_read_finish - block_read_start;
-		block_read(fat_idx + superblock->data_block_start_index, buffer);
-		memcpy(&output_buffer[output_buffer_index], &buffer[block_read_start], block_read_amount);
-		file->offset += block_read_amount;
-		output_buffer_index += block_read_amount;
-		bytes_left_to_read -= block_read_amount;
-		bytes_read += block_read_amount;
-		fat_idx = fat->entries[fat_idx];
-		block_read_start = 0;
-		block_read_finish = bytes_left_to_read;
-		if (block_read_finish > BLOCK_SIZE) {
-			block_read_finish = BLOCK_SIZE;
+	// Read each contiguous run of the FAT chain with a single call
+	if (transfer_ret == 0) {
+		transfer_ret = transfer_block_runs(fat_idx, block_buffers, file->transfer_requests, num_blocks, false);
+	}
+
+	if (bounce != NULL && transfer_ret == 0) {
+		transfer_cursor_rewind(&cursor);
+		for (size_t i = 0; i < num_blocks; i++) {
+			uint8_t *data;
+			size_t output_offset = i * BLOCK_SIZE - offset_in_block;
+			if (block_buffers[i] != NULL
+				&& transfer_piece(&cursor, output_offset, BLOCK_SIZE, &data) < BLOCK_SIZE) {
+				transfer_copy(&cursor, output_offset, block_buffers[i], BLOCK_SIZE, true);
+			}
 		}
 	}
 
-	free(buffer);
+	free(bounce);
+
+	if (transfer_ret == -1) {
+		return -1;
+	}
+
+	file->cursor_block = start_block_location + num_blocks - 1;
+	file->cursor_fat_idx = last_fat_idx;
+
+	int read_offset = file->offset;
+	bytes_read = bytes_left_to_read;
+	file->offset += bytes_read;
+
+	// Keep the next blocks coming if the file is read sequentially
+	file_readahead(file, read_offset, start_block_location + num_blocks - 1, last_fat_idx);
 	return bytes_read;
 }
 
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	// Error checking
+	if (!validate_iovec(iov, iovcnt)) {
+		return -1;
+	}
+	file_descriptor_entry_t file = file_descriptor_enter(fd);
+	if (file == NULL) {
+		return -1;
+	}
+
+	// Reads of a file only exclude its writes, and go on in parallel with
+	// each other and with any access to other files. They see the small
+	// writes to the file once flushed
+	if (file_write_flush(file) == -1) {
+		file_descriptor_exit(file);
+		return -1;
+	}
+	pthread_rwlock_rdlock(&file->inode->lock);
+	int ret = file_read(file, iov, iovcnt);
+	pthread_rwlock_unlock(&file->inode->lock);
+	file_descriptor_exit(file);
+	return ret;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	return fs_readv(fd, &iov, 1);
+}
+
+// Descriptors of the positional calls of each thread, which keep their
+// transfer arrays from one call to the next
+pthread_once_t view_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t view_key;               // frees the descriptor of a thread when it exits
+__thread struct file_descriptor_entry *view_self;
+
+void view_release(void *view) {
+	free(((file_descriptor_entry_t) view)->transfer_buffers);
+	free(((file_descriptor_entry_t) view)->transfer_requests);
+	free(view);
+}
+
+void view_key_create() {
+	pthread_key_create(&view_key, view_release);
+}
+
+file_descriptor_entry_t file_descriptor_view(int fd) {
+	// Positional calls work on a descriptor of their thread pointing to the
+	// same inode, leaving the offset and cursors of fd alone, so that calls on
+	// the same descriptor can run at once. fd keeps the inode until they return
+	if (view_self == NULL) {
+		pthread_once(&view_key_once, view_key_create);
+		view_self = calloc(1, sizeof(struct file_descriptor_entry));
+		if (view_self == NULL) {
+			return NULL;
+		}
+		pthread_setspecific(view_key, view_self);
+	}
+	file_descriptor_entry_t file = file_descriptor_enter(fd);
+	if (file == NULL) {
+		return NULL;
+	}
+	if (file_write_flush(file) == -1) {
+		file_descriptor_exit(file);
+		return NULL;
+	}
+	file_descriptor_entry_t view = view_self;
+	view->inode = file->inode;
+	view->fd = fd;
+	view->allocation_goal = file->allocation_goal;
+	view->cursor_block = -1;
+	view->readahead_next = 0;
+	view->readahead_window = 0;
+	view->readahead_until = 0;
+	__atomic_add_fetch(&file->positional_calls, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&file->lock);
+	return view;
+}
+
+int file_descriptor_view_exit(file_descriptor_entry_t view, int ret) {
+	__atomic_sub_fetch(&file_descriptor(view->fd)->positional_calls, 1, __ATOMIC_RELEASE);
+	view->inode = NULL;
+	mount_exit();
+	return ret;
+}
+
+int fs_pread(int fd, void *buf, size_t count, uint64_t offset)
+{
+	// Error checking
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	file_descriptor_entry_t view;
+	if (buf == NULL || (view = file_descriptor_view(fd)) == NULL) {
+		return -1;
+	}
+
+	// Validate offset, then read as fs_read() does from there
+	int ret = -1;
+	pthread_rwlock_rdlock(&view->inode->lock);
+	if (offset <= view->inode->file_entry->file_size) {
+		view->offset = offset;
+		ret = file_read(view, &iov, 1);
+	}
+	pthread_rwlock_unlock(&view->inode->lock);
+	return file_descriptor_view_exit(view, ret);
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, uint64_t offset)
+{
+	// Error checking
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	file_descriptor_entry_t view;
+	if (buf == NULL || (view = file_descriptor_view(fd)) == NULL) {
+		return -1;
+	}
+
+	// Validate offset, which stays valid as files only grow while open
+	int ret = -1;
+	pthread_rwlock_rdlock(&view->inode->lock);
+	bool valid = offset <= view->inode->file_entry->file_size;
+	pthread_rwlock_unlock(&view->inode->lock);
+	if (valid) {
+		view->offset = offset;
+		ret = file_write_exclusive(view, &iov, 1);
+	}
+	return file_descriptor_view_exit(view, ret);
+}
@@ -2,16 +2,50 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint64_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/** Maximum path length (including the NULL character) */
+#define FS_PATH_MAX 256
+
+/**
+ * Number of files held by the root directory block. Past it, the root directory
+ * grows with extension blocks taken from the data blocks.
+ */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Maximum number of open files when the limit is not configured */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Environment variable overriding, at mount time, the maximum number of open files */
+#define FS_OPEN_MAX_ENV "LIBFS_OPEN_MAX"
+
+/**
+ * Environment variable turning on, when set to 1 at mount time, the storage of
+ * files of up to about 256 bytes in the entries of their directory instead of
+ * in data blocks. Once turned on, it stays on for the disk, which other
+ * implementations of the file system can no longer mount.
+ */
+#define FS_INLINE_DATA_ENV "LIBFS_INLINE_DATA"
+
+/** Flag of fs_open_flags() combining the small writes made through a descriptor */
+#define FS_OPEN_BUFFERED 0x1
+
+/**
+ * struct fs_dirent - Directory entry
+ * @name: File name, NULL-terminated
+ * @size: Size of the file, or of the directory blocks of a directory
+ * @is_directory: Whether the entry is a directory
+ */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	int is_directory;
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,6 +54,14 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * All the functions of this API can be called from several threads at once.
+ * Each call is atomic with respect to the others, and calls on different files
+ * run in parallel. Reads of a file through different descriptors run in
+ * parallel as well, and only wait for writes to the file. Opening a file in a
+ * directory already walked through does not wait for files being created or
+ * deleted. Calls using the same descriptor run one at a time, and calls made
+ * while fs_mount() or fs_umount() run fail as if no disk was mounted.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
@@ -36,6 +78,19 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Synchronize file system
+ *
+ * Write back the file data and the metadata (FAT blocks and root directory) of
+ * the currently mounted file system that changed since they were last written,
+ * and wait until they have reached the storage holding the virtual disk file.
+ * Only changed blocks are written, which keeps periodic calls cheap.
+ *
+ * Return: -1 if no FS is currently mounted, or if the data or metadata cannot
+ * be written. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -49,27 +104,51 @@ int fs_info(void);
  * fs_create - Create a new file
  * @filename: File name
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file named @filename in the mounted file system.
+ * String @filename is a path: file names separated by '/', optionally starting
+ * with '/', where all but the last name are directories. A path without '/'
+ * names a file of the root directory. The path must be NULL-terminated and
+ * shorter than %FS_PATH_MAX characters, and each file name cannot exceed
+ * %FS_FILENAME_LEN characters (including the NULL character).
+ *
+ * File systems from before directories treated '/' as an ordinary character
+ * of file names. For compatibility with the files they hold, a path whose first
+ * name is not a directory of the root directory names, as a whole, a file of
+ * the root directory, provided it fits in %FS_FILENAME_LEN characters. Such a
+ * file can no longer be reached once a directory with that first name exists.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if the directory is full and there is no free data block to extend it with.
+ * 0 otherwise.
  */
 int fs_create(const char *filename);
 
+/**
+ * fs_mkdir - Create a new directory
+ * @path: Directory path
+ *
+ * Create a new and empty directory at @path, following the same rules as
+ * fs_create(). Directories are stored in the data blocks, and only take some
+ * once they hold files.
+ *
+ * Return: -1 if no FS is currently mounted, or if @path is invalid, or if a
+ * file named @path already exists, or if a directory leading to @path does not
+ * exist, or if the parent directory is full and there is no free data block to
+ * extend it with. 0 otherwise.
+ */
+int fs_mkdir(const char *path);
+
 /**
  * fs_delete - Delete a file
  * @filename: File name
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file or the empty directory named @filename, a path as described
+ * in fs_create(), from the mounted file system.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * there is no file named @filename to delete, or if file @filename is
+ * currently open, or if it is a directory that is not empty. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
@@ -82,6 +161,24 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_readdir - Read directory entries
+ * @path: Directory path, "/" or an empty string for the root directory
+ * @cursor: Position in the directory, to be set to 0 for the first call
+ * @entries: Array to be filled with the entries read
+ * @count: Number of entries @entries can hold
+ *
+ * Fill @entries with up to @count entries of the directory at @path, starting
+ * from @cursor, and advance @cursor past them. Calling fs_readdir() again with
+ * the same @cursor returns the next entries. Listing a directory only costs the
+ * number of entries it holds.
+ *
+ * Return: -1 if no FS is currently mounted, or if @path is not a directory, or
+ * if @cursor or @entries is NULL. Otherwise return the number of entries read,
+ * which is 0 once the whole directory has been read.
+ */
+int fs_readdir(const char *path, size_t *cursor, struct fs_dirent *entries, size_t count);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -92,15 +189,40 @@ int fs_ls(void);
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * simultaneously, unless a different limit was set with %FS_OPEN_MAX_ENV when
+ * the file system was mounted.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
+ * there is no file named @filename to open, or if it is a directory, or if
+ * the maximum number of files are already open. Otherwise, return the file
  * descriptor.
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_flags - Open a file with flags
+ * @filename: File name
+ * @flags: Bitwise OR of flags, 0 or %FS_OPEN_BUFFERED
+ *
+ * Open file named @filename as fs_open() does. With %FS_OPEN_BUFFERED, the
+ * writes of less than a block made through the file descriptor are combined in
+ * memory with the writes to the file that they continue, and the offset of the
+ * file descriptor moves past them right away. They reach the file once they
+ * fill the rest of a block, and before any other write to the file, read of
+ * it, fs_stat() of it or fs_close() or fs_fsync() of one of its file
+ * descriptors, through whichever file descriptor, as well as before fs_sync().
+ * Seeking with fs_lseek() up to their end is allowed. A failure to write them
+ * is reported by the call that flushed them, and leaves the file descriptors
+ * that made them past the end of the file until moved back with fs_lseek().
+ * From then on, fs_write() fails on every %FS_OPEN_BUFFERED descriptor of the
+ * file until all of its descriptors are closed. A small write starting past
+ * the end of the file fails as well, rather than being combined.
+ *
+ * Return: -1 if @flags holds unknown flags, and in the cases fs_open() fails.
+ * Otherwise, return the file descriptor.
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
@@ -112,6 +234,20 @@ int fs_open(const char *filename);
  */
 int fs_close(int fd);
 
+/**
+ * fs_fsync - Synchronize a file
+ * @fd: File descriptor
+ *
+ * Make the content and size of the file referenced by file descriptor @fd
+ * durable. As the metadata of all files shares the same blocks, this currently
+ * does the same as fs_sync().
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the file cannot be
+ * written back. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
 /**
  * fs_stat - Get file status
  * @fd: File descriptor
@@ -182,4 +318,71 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write as fs_write() does the data of the @iovcnt buffers of @iov, one after
+ * the other, as if they were a single buffer.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov or the base of one
+ * of its buffers is NULL, or if @iovcnt is negative. Otherwise return the
+ * number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read as fs_read() does into the @iovcnt buffers of @iov, filling each one
+ * before the next, as if they were a single buffer.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov or the base of one
+ * of its buffers is NULL, or if @iovcnt is negative. Otherwise return the
+ * number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Read as fs_read() does, starting at @offset instead of the file offset of the
+ * file descriptor, which is left unchanged. Calls to fs_pread() on the same file
+ * descriptor run in parallel with each other.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number of
+ * bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, uint64_t offset);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Write as fs_write() does, starting at @offset instead of the file offset of
+ * the file descriptor, which is left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number of
+ * bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, uint64_t offset);
+
 #endif /* _FS_H */
@@ -0,0 +1,286 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "journal.h"
+
+#define journal_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* "ECSJRNL" */
+#define JOURNAL_MAGIC 0x004c4e524a534345ull
+
+/* First block of the journal, locating the transactions to replay */
+struct __attribute__((packed)) journal_header {
+	uint64_t magic;
+	/* Sequence number of the first transaction to replay */
+	uint32_t sequence;
+};
+
+/* Start of each transaction, followed by its records */
+struct __attribute__((packed)) journal_transaction {
+	uint64_t magic;
+	uint32_t sequence;
+	/* Length in bytes of the records */
+	uint32_t length;
+	/* Checksum of the records, telling torn transactions apart */
+	uint32_t checksum;
+};
+
+/* Journal instance */
+static struct {
+	/* Blocks of the journal on disk, length is 0 when closed */
+	size_t start;
+	size_t length;
+	/* Sequence number of the next transaction */
+	uint32_t sequence;
+	/* Log block, counted after the header, of the next transaction */
+	size_t head;
+	/* Aligned transfer buffer */
+	char *buf;
+	size_t buf_blocks;
+} journal;
+
+static size_t journal_log_blocks(void)
+{
+	return journal.length - 1;
+}
+
+/* FNV-1a, seeded with the sequence number so that stale records do not match */
+static uint32_t journal_checksum(uint32_t sequence, const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	uint32_t hash = 2166136261u ^ sequence;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Make the transfer buffer hold at least @count blocks */
+static int journal_reserve(size_t count)
+{
+	char *buf;
+
+	if (count <= journal.buf_blocks)
+		return 0;
+
+	if (posix_memalign((void **)&buf, BLOCK_SIZE, count * BLOCK_SIZE))
+		return -1;
+
+	free(journal.buf);
+	journal.buf = buf;
+	journal.buf_blocks = count;
+
+	return 0;
+}
+
+/* Transfer @count blocks of the log starting at log block @first */
+static int journal_transfer(size_t first, size_t count, int write)
+{
+	void *bufs[count];
+	size_t block = journal.start + 1 + first;
+
+	for (size_t i = 0; i < count; i++)
+		bufs[i] = &journal.buf[i * BLOCK_SIZE];
+
+	return write ? block_writev(block, (const void **)bufs, count)
+		: block_readv(block, bufs, count);
+}
+
+static int journal_write_header(void)
+{
+	struct journal_header *header = (struct journal_header *)journal.buf;
+
+	memset(journal.buf, 0, BLOCK_SIZE);
+	header->magic = JOURNAL_MAGIC;
+	header->sequence = journal.sequence;
+
+	if (block_write(journal.start, journal.buf) == -1)
+		return -1;
+
+	return block_disk_sync();
+}
+
+static int journal_setup(size_t start, size_t length)
+{
+	if (journal.length) {
+		journal_error("journal already open");
+		return -1;
+	}
+
+	if (length < 2) {
+		journal_error("invalid journal length '%zu'", length);
+		return -1;
+	}
+
+	if (journal_reserve(1) == -1)
+		return -1;
+
+	journal.start = start;
+	journal.length = length;
+	journal.head = 0;
+
+	return 0;
+}
+
+int journal_format(size_t start, size_t length)
+{
+	if (journal_setup(start, length) == -1)
+		return -1;
+
+	journal.sequence = 1;
+	if (journal_write_header() == -1) {
+		journal_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+int journal_open(size_t start, size_t length)
+{
+	struct journal_header *header;
+
+	if (journal_setup(start, length) == -1)
+		return -1;
+
+	header = (struct journal_header *)journal.buf;
+	if (block_read(start, journal.buf) == -1 ||
+	    header->magic != JOURNAL_MAGIC) {
+		journal_error("no journal found at block %zu", start);
+		journal_close();
+		return -1;
+	}
+
+	journal.sequence = header->sequence;
+
+	return 0;
+}
+
+void journal_close(void)
+{
+	free(journal.buf);
+	journal.buf = NULL;
+	journal.buf_blocks = 0;
+	journal.length = 0;
+}
+
+int journal_replay(int (*apply)(const void *records, size_t length))
+{
+	struct journal_transaction *trans;
+	int replayed = 0;
+
+	if (!journal.length) {
+		journal_error("no journal open");
+		return -1;
+	}
+
+	while (journal.head < journal_log_blocks()) {
+		size_t count;
+
+		if (journal_transfer(journal.head, 1, 0) == -1)
+			return -1;
+
+		/* Anything but the next transaction ends the journal */
+		trans = (struct journal_transaction *)journal.buf;
+		if (trans->magic != JOURNAL_MAGIC ||
+		    trans->sequence != journal.sequence)
+			break;
+
+		count = (sizeof(*trans) + trans->length + BLOCK_SIZE - 1)
+			/ BLOCK_SIZE;
+		if (journal.head + count > journal_log_blocks())
+			break;
+
+		if (journal_reserve(count) == -1 ||
+		    journal_transfer(journal.head, count, 0) == -1)
+			return -1;
+
+		trans = (struct journal_transaction *)journal.buf;
+		if (trans->checksum != journal_checksum(trans->sequence,
+							 trans + 1,
+							 trans->length))
+			break;
+
+		if (apply(trans + 1, trans->length) == -1)
+			return -1;
+
+		journal.head += count;
+		journal.sequence++;
+		replayed++;
+	}
+
+	return replayed;
+}
+
+int journal_commit(const void *records, size_t length)
+{
+	struct journal_transaction *trans;
+	size_t count = (sizeof(*trans) + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (!journal.length) {
+		journal_error("no journal open");
+		return -1;
+	}
+
+	if (journal.head + count > journal_log_blocks())
+		return 1;
+
+	if (journal_reserve(count) == -1)
+		return -1;
+
+	trans = (struct journal_transaction *)journal.buf;
+	trans->magic = JOURNAL_MAGIC;
+	trans->sequence = journal.sequence;
+	trans->length = length;
+	trans->checksum = journal_checksum(journal.sequence, records, length);
+	memcpy(trans + 1, records, length);
+	memset((char *)(trans + 1) + length, 0,
+	       count * BLOCK_SIZE - sizeof(*trans) - length);
+
+	/* The transaction is committed once it is durable */
+	if (journal_transfer(journal.head, count, 1) == -1 ||
+	    block_disk_sync() == -1)
+		return -1;
+
+	journal.head += count;
+	journal.sequence++;
+
+	return 0;
+}
+
+size_t journal_room(void)
+{
+	size_t blocks;
+
+	if (!journal.length)
+		return 0;
+
+	blocks = journal_log_blocks() - journal.head;
+	if (!blocks)
+		return 0;
+
+	return blocks * BLOCK_SIZE - sizeof(struct journal_transaction);
+}
+
+int journal_reset(void)
+{
+	if (!journal.length) {
+		journal_error("no journal open");
+		return -1;
+	}
+
+	/* Transactions in the log now have stale sequence numbers */
+	if (journal_write_header() == -1)
+		return -1;
+
+	journal.head = 0;
+
+	return 0;
+}
@@ -0,0 +1,99 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Environment variable giving the size in blocks of the journal to create */
+#define JOURNAL_BLOCKS_ENV "LIBFS_JOURNAL_BLOCKS"
+
+/**
+ * Environment variable giving how long in milliseconds a commit waits for
+ * other operations to add their changes to it
+ */
+#define JOURNAL_COMMIT_MS_ENV "LIBFS_JOURNAL_COMMIT_MS"
+
+/**
+ * journal_format - Create an empty journal
+ * @start: Index of the first block of the journal on disk
+ * @length: Number of blocks of the journal, including its header block
+ *
+ * Write an empty journal in the @length blocks starting at block @start of the
+ * currently open virtual disk, and make it durable. The journal is left open,
+ * as with journal_open().
+ *
+ * Return: -1 if a journal is already open, if @length is smaller than 2 or if
+ * the journal cannot be written. 0 otherwise.
+ */
+int journal_format(size_t start, size_t length);
+
+/**
+ * journal_open - Open an existing journal
+ * @start: Index of the first block of the journal on disk
+ * @length: Number of blocks of the journal, including its header block
+ *
+ * Return: -1 if a journal is already open, if @length is smaller than 2 or if
+ * the blocks do not hold a journal. 0 otherwise.
+ */
+int journal_open(size_t start, size_t length);
+
+/**
+ * journal_close - Close the journal
+ *
+ * Transactions committed since the last journal_reset() stay in the journal, to
+ * be replayed when it is opened again.
+ */
+void journal_close(void);
+
+/**
+ * journal_replay - Replay committed transactions
+ * @apply: Function called with the records of each transaction
+ *
+ * Call @apply with the records of each transaction committed since the last
+ * journal_reset(), in commit order. A transaction that was only partly written
+ * when the journal was last used ends the replay. New transactions are
+ * committed after the replayed ones.
+ *
+ * Return: -1 if a transaction cannot be read or if @apply returns -1. The
+ * number of replayed transactions otherwise.
+ */
+int journal_replay(int (*apply)(const void *records, size_t length));
+
+/**
+ * journal_commit - Commit a transaction
+ * @records: Records of the transaction
+ * @length: Length in bytes of @records
+ *
+ * Append a transaction holding @records to the journal, and wait until it is
+ * durable. The content of @records is up to the caller.
+ *
+ * Return: -1 if the journal is not open or if the transaction cannot be
+ * written. 1 if there is no room left for the transaction, which callers avoid
+ * by checking journal_room() beforehand. 0 otherwise.
+ */
+int journal_commit(const void *records, size_t length);
+
+/**
+ * journal_room - Room left in the journal
+ *
+ * Once the room runs low, the caller is expected to write the state described
+ * by the committed transactions in place and to call journal_reset(), before
+ * any part of a transaction that is not committed reaches its place on disk.
+ *
+ * Return: the length in bytes of the records that the next transaction can
+ * hold, 0 if the journal is not open or is full.
+ */
+size_t journal_room(void);
+
+/**
+ * journal_reset - Empty the journal
+ *
+ * Discard every committed transaction, once the state they describe has been
+ * made durable elsewhere. The journal header is written and made durable before
+ * returning, so that discarded transactions are never replayed.
+ *
+ * Return: -1 if the journal is not open or if its header cannot be written. 0
+ * otherwise.
+ */
+int journal_reset(void);
+
+#endif /* _JOURNAL_H */